@@ -0,0 +1,233 @@
+/*
+ * Copyright 2018 Thomas Bocek
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ */
+
+/*
+ * Replay benchmark
+ * ================
+ *
+ * Replays an evtest trace through the remapping core, compares the output with a golden
+ * file, and measures the throughput of remap_event():
+ *
+ *   bench [-l LAYOUT] [-r RULES] [-c] [-t] [-n ROUNDS] [-u] TRACE GOLDEN
+ *
+ * A trace is the output of evtest, all other lines are ignored. The golden file contains one
+ * "type code value" line per output event. With -u the golden file is written instead.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include "remap.h"
+
+static struct input_event *read_trace(const char *path, size_t *n_events) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return NULL;
+    }
+    size_t n = 0, cap = 1024;
+    struct input_event *evs = malloc(cap * sizeof *evs);
+    char line[512];
+    while (evs != NULL && fgets(line, sizeof line, file) != NULL) {
+        struct input_event ev = {0};
+        long sec, usec;
+        int type, code;
+        char value[32];
+        if (sscanf(line, "Event: time %ld.%ld,", &sec, &usec) != 2) {
+            continue;
+        }
+        ev.time.tv_sec = sec;
+        ev.time.tv_usec = usec;
+        const char *rest = strchr(line, ',') + 1;
+        if (sscanf(rest, " type %d (%*[^)]), code %d (%*[^)]), value %31s", &type, &code, value) == 3) {
+            ev.type = type;
+            ev.code = code;
+            //evtest prints scan codes in hex
+            ev.value = (int) strtol(value, NULL, type == EV_MSC ? 16 : 10);
+        } else if (strstr(rest, "SYN_REPORT") != NULL) {
+            ev.type = EV_SYN;
+            ev.code = SYN_REPORT;
+        } else if (strstr(rest, "SYN_DROPPED") != NULL) {
+            ev.type = EV_SYN;
+            ev.code = SYN_DROPPED;
+        } else {
+            continue;
+        }
+        if (n == cap) {
+            cap *= 2;
+            struct input_event *grown = realloc(evs, cap * sizeof *evs);
+            if (grown == NULL) {
+                free(evs);
+                evs = NULL;
+                break;
+            }
+            evs = grown;
+        }
+        evs[n++] = ev;
+    }
+    fclose(file);
+    *n_events = n;
+    return evs;
+}
+
+static size_t sink_events(FILE *file, const struct input_event *evs, size_t n) {
+    for (size_t k = 0; file != NULL && k < n; k++) {
+        fprintf(file, "%d %d %d\n", evs[k].type, evs[k].code, evs[k].value);
+    }
+    return n;
+}
+
+static size_t sink(FILE *file, struct out_buf *out, int len) {
+    sink_events(file, out->ev, len);
+    out->len = 0;
+    return len;
+}
+
+//feeds the events through the remapping like read_device() does, with or without the pass-through fast path.
+//The output is written to file if it is not NULL, the number of output events is returned.
+static size_t run(const struct remap_config *config, const struct input_event *evs, size_t n, bool fast,
+                  FILE *file) {
+    struct remap_state state = {0};
+    struct out_buf out = { .len = 0 };
+    size_t emitted = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (fast && remap_idle(&state)) {
+            size_t pass = remap_passthrough(config, &state, &evs[i], n - i);
+            if (pass > 0) {
+                emitted += sink(file, &out, out.len) + sink_events(file, &evs[i], pass);
+                i += pass;
+                if (i == n) {
+                    break;
+                }
+            }
+        }
+        if (out.len > OUT_MAX - REMAP_EVENT_MAX) {
+            emitted += sink(file, &out, out.len);
+        }
+        remap_event(config, &state, &evs[i], &out);
+    }
+    return emitted + sink(file, &out, out.len);
+}
+
+static bool same_file(FILE *a, FILE *b) {
+    int ca, cb;
+    do {
+        ca = fgetc(a);
+        cb = fgetc(b);
+    } while (ca == cb && ca != EOF);
+    return ca == cb;
+}
+
+int main(int argc, char *argv[]) {
+    const char *layout_name = "dvorak",
+               *rules_path = NULL;
+    bool no_toggle = false, no_caps_lock = false, update = false;
+    long rounds = 2000;
+    int opt;
+    while ((opt = getopt(argc, argv, "l:r:ctn:u")) != -1) {
+        switch (opt) {
+            case 'l':
+                layout_name = optarg;
+                break;
+            case 'r':
+                rules_path = optarg;
+                break;
+            case 'c':
+                no_caps_lock = true;
+                break;
+            case 't':
+                no_toggle = true;
+                break;
+            case 'n':
+                rounds = strtol(optarg, NULL, 10);
+                break;
+            case 'u':
+                update = true;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-l LAYOUT] [-r RULES] [-c] [-t] [-n ROUNDS] [-u] TRACE GOLDEN\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (argc - optind != 2) {
+        fprintf(stderr, "usage: %s [-l LAYOUT] [-r RULES] [-c] [-t] [-n ROUNDS] [-u] TRACE GOLDEN\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *trace = argv[optind], *golden = argv[optind + 1];
+
+    const struct layout *layout = find_layout(layout_name);
+    if (layout == NULL) {
+        return EXIT_FAILURE;
+    }
+    struct remap_config config;
+    const struct rules *rules = NULL;
+    if (rules_path != NULL && (rules = rules_load(rules_path)) == NULL) {
+        return EXIT_FAILURE;
+    }
+    remap_init(&config, layout, rules, no_toggle, no_caps_lock);
+
+    size_t n;
+    struct input_event *evs = read_trace(trace, &n);
+    if (evs == NULL || n == 0) {
+        fprintf(stderr, "%s: no events\n", trace);
+        return EXIT_FAILURE;
+    }
+
+    if (update) {
+        FILE *file = fopen(golden, "w");
+        if (file == NULL) {
+            perror(golden);
+            return EXIT_FAILURE;
+        }
+        run(&config, evs, n, false, file);
+        fclose(file);
+    }
+    //the fast path must not change the output
+    for (int fast = 0; fast < 2; fast++) {
+        FILE *expected = fopen(golden, "r"), *actual = tmpfile();
+        if (expected == NULL || actual == NULL) {
+            perror(golden);
+            return EXIT_FAILURE;
+        }
+        run(&config, evs, n, fast, actual);
+        rewind(actual);
+        if (!same_file(expected, actual)) {
+            fprintf(stderr, "FAIL %s: output%s differs from %s\n", trace, fast ? " with the fast path" : "", golden);
+            return EXIT_FAILURE;
+        }
+        fclose(expected);
+        fclose(actual);
+    }
+
+    double ns[2];
+    size_t emitted = 0;
+    for (int fast = 0; fast < 2; fast++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (long r = 0; r < rounds; r++) {
+            emitted = run(&config, evs, n, fast, NULL);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        ns[fast] = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / ((double) n * rounds);
+    }
+    printf("%-32s %6zu events %6.2f ns/event %8.2f Mevents/s, %6.2f ns/event without fast path (%zu emitted)\n",
+           trace, n, ns[1], 1e3 / ns[1], ns[0], emitted);
+    free(evs);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,237 @@
+/*
+ * Copyright 2018 Thomas Bocek
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ */
+
+/*
+ * Invariants
+ * ==========
+ *
+ * Shared by the fuzzer and the stress test. After every frame:
+ *
+ * - the fast path and remap_event() alone produced the same events,
+ * - no output key was released or repeated more often than it was pressed,
+ * - the keys the core tracks as held are the keys of the keyboard,
+ * - a key that is held as remapped is held on the keyboard.
+ *
+ * At the end every key of the keyboard is released, and no output key may be left pressed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "check.h"
+
+static void fail(const char *what, int code, int value) {
+    fprintf(stderr, "FAIL: %s, code %d value %d\n", what, code, value);
+    abort();
+}
+
+void check_init(struct check *check, const struct remap_config *config) {
+    memset(check, 0, sizeof *check);
+    check->config = config;
+    check->last = -1;
+}
+
+static void count_output(struct check *check, int path, const struct input_event *evs, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        const struct input_event *ev = &evs[i];
+        if (ev->type != EV_KEY) {
+            continue;
+        }
+        int *count = &check->out_count[path][ev->code];
+        if (ev->value == 1) {
+            (*count)++;
+        } else if (*count == 0) {
+            //a repeat or a release of a key that is not pressed on the output
+            fail(ev->value == 0 ? "release without press" : "repeat without press", ev->code, ev->value);
+        } else if (ev->value == 0) {
+            (*count)--;
+        }
+    }
+    check->events_out += path == 0 ? n : 0;
+}
+
+//one read() of the device, in the way read_device() handles it, returns the events written in out
+static size_t feed(struct check *check, int path, const struct input_event *evs, size_t count,
+                   struct input_event *out_evs) {
+    static struct out_buf out;
+    struct remap_state *state = &check->state[path];
+    size_t n_out = 0;
+    out.len = 0;
+    for (size_t k = 0; k < count; k++) {
+        if (path == 1 && remap_idle(state)) {
+            size_t pass = remap_passthrough(check->config, state, &evs[k], count - k);
+            if (pass > 0) {
+                memcpy(out_evs + n_out, out.ev, out.len * sizeof *out.ev);
+                n_out += out.len;
+                out.len = 0;
+                memcpy(out_evs + n_out, &evs[k], pass * sizeof *evs);
+                n_out += pass;
+                k += pass;
+                if (k == count) {
+                    break;
+                }
+            }
+        }
+        if (state->dropped) {
+            if (evs[k].type == EV_SYN && evs[k].code == SYN_REPORT) {
+                static struct input_event sync[REMAP_RESYNC_MAX];
+                size_t n = remap_resync(check->config, state, check->kernel, evs[k].time, sync);
+                for (size_t i = 0; i < n; i++) {
+                    remap_event(check->config, state, &sync[i], &out);
+                    memcpy(out_evs + n_out, out.ev, out.len * sizeof *out.ev);
+                    n_out += out.len;
+                    out.len = 0;
+                }
+            }
+            continue;
+        }
+        remap_event(check->config, state, &evs[k], &out);
+        memcpy(out_evs + n_out, out.ev, out.len * sizeof *out.ev);
+        n_out += out.len;
+        out.len = 0;
+    }
+    return n_out;
+}
+
+static void check_frame(struct check *check, const struct input_event *evs, size_t count) {
+    static struct input_event out[2][4 * REMAP_RESYNC_MAX];
+    size_t n[2];
+    for (int path = 0; path < 2; path++) {
+        n[path] = feed(check, path, evs, count, out[path]);
+        count_output(check, path, out[path], n[path]);
+    }
+    check->events_in += count;
+    for (size_t i = 0; check->record != NULL && i < count && check->n_record < check->max_record; i++) {
+        check->record[check->n_record++] = evs[i];
+    }
+    if (n[0] != n[1] || memcmp(out[0], out[1], n[0] * sizeof out[0][0]) != 0) {
+        fail("the fast path changed the output", evs[0].code, evs[0].value);
+    }
+    const struct remap_state *state = &check->state[0];
+    if (state->dropped) {
+        return;
+    }
+    for (int code = 0; code < KEY_CNT; code++) {
+        bool down = (state->down[code / 64] >> (code % 64)) & 1;
+        if (down != check_down(check, code)) {
+            fail("held keys differ from the keyboard", code, down);
+        }
+        if (code < LAYOUT_KEYS && remap_held(state, code) && !down) {
+            fail("remapped key is not held", code, 0);
+        }
+    }
+}
+
+void check_lost(struct check *check, int code, int value) {
+    unsigned long *word = &check->kernel[code / (8 * sizeof(long))], bit = 1UL << (code % (8 * sizeof(long)));
+    if (value == 1) {
+        *word |= bit;
+    } else if (value == 0) {
+        *word &= ~bit;
+    }
+}
+
+void check_key(struct check *check, int code, int value) {
+    check_lost(check, code, value);
+    struct timeval time = { .tv_sec = (time_t) (check->now / 1000000), .tv_usec = check->now % 1000000 };
+    check->now += 1000;
+    struct input_event evs[2] = {
+        { .time = time, .type = EV_KEY, .code = code, .value = value },
+        { .time = time, .type = EV_SYN, .code = SYN_REPORT },
+    };
+    check_frame(check, evs, 2);
+}
+
+void check_dropped(struct check *check) {
+    struct input_event ev = { .type = EV_SYN, .code = SYN_DROPPED };
+    check_frame(check, &ev, 1);
+}
+
+void check_wait(struct check *check, int ms) {
+    check->now += ms * 1000LL;
+    if (check->config->rules == NULL) {
+        return;
+    }
+    static struct out_buf out[2];
+    for (int path = 0; path < 2; path++) {
+        out[path].len = 0;
+        remap_timeout(check->config, &check->state[path], check->now, &out[path]);
+        count_output(check, path, out[path].ev, out[path].len);
+    }
+    if (out[0].len != out[1].len || memcmp(out[0].ev, out[1].ev, out[0].len * sizeof out[0].ev[0]) != 0) {
+        fail("the fast path changed the output of the timer", 0, 0);
+    }
+}
+
+static const int keys[CHECK_KEYS] = {
+    KEY_Q, KEY_W, KEY_E, KEY_I, KEY_J, KEY_K, KEY_C, KEY_V, KEY_X, KEY_Z, KEY_S, KEY_H,
+    KEY_LEFTCTRL, KEY_RIGHTCTRL, KEY_LEFTALT, KEY_LEFTMETA, KEY_CAPSLOCK, KEY_LEFTSHIFT, KEY_RIGHTSHIFT,
+    KEY_SPACE, KEY_RIGHTALT, KEY_ESC, KEY_LEFT, KEY_DOWN, KEY_F4,
+    KEY_ENTER, KEY_1, KEY_SEMICOLON, KEY_VOLUMEUP, KEY_KPENTER, KEY_BRIGHTNESSUP, KEY_MICMUTE,
+};
+
+void check_op(struct check *check, unsigned int op) {
+    int code = keys[op % CHECK_KEYS], value = !check_down(check, code);
+    switch ((op / CHECK_KEYS) % 8) {
+        case 4:
+            //the kernel repeats the last key that was pressed, as long as it is held
+            if (check->last >= 0 && check_down(check, check->last)) {
+                code = check->last;
+                value = 2;
+            }
+            break;
+        case 5:
+            check_dropped(check);
+            check->losing = true;
+            return;
+        case 6:
+            if (check->losing) {
+                check_lost(check, code, value);
+            } else {
+                //as long as a tap-hold key can be held, sometimes longer
+                check_wait(check, (op & 1) ? 50 : RULES_HOLD_MS);
+            }
+            return;
+        case 7:
+            //left alt is tapped, three taps in a row toggle the mapping
+            if (!check_down(check, KEY_LEFTALT) && !check->losing) {
+                check_key(check, KEY_LEFTALT, 1);
+                check_key(check, KEY_LEFTALT, 0);
+                return;
+            }
+            break;
+    }
+    check->losing = false;
+    if (value == 1) {
+        check->last = code;
+    }
+    check_key(check, code, value);
+}
+
+void check_finish(struct check *check) {
+    for (int code = 0; code < KEY_CNT; code++) {
+        if (check_down(check, code)) {
+            check_key(check, code, 0);
+        }
+    }
+    for (int path = 0; path < 2; path++) {
+        for (int code = 0; code < KEY_CNT; code++) {
+            if (check->out_count[path][code] != 0) {
+                fail("key is still pressed on the output", code, check->out_count[path][code]);
+            }
+        }
+    }
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright 2018 Thomas Bocek
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ */
+
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "remap.h"
+
+//a simulated keyboard that feeds the remapping core twice, like read_device() with and without the fast path,
+//and checks the output after every frame. A failed check prints the reason and aborts, which is what the
+//fuzzer looks for.
+struct check {
+    const struct remap_config *config;
+    struct remap_state state[2];
+    //the keys the kernel would report with EVIOCGKEY
+    unsigned long kernel[KEY_CNT / (8 * sizeof(long)) + 1];
+    //presses minus releases of every output key, per path
+    int out_count[2][KEY_CNT];
+    uint64_t events_in,
+             events_out;
+    //the key that autorepeats, and whether events are being lost after a SYN_DROPPED
+    int last;
+    bool losing;
+    //the event clock in microseconds, every frame takes 1 ms
+    long long now;
+    //if not NULL, the input events are appended here until max_record
+    struct input_event *record;
+    size_t n_record,
+           max_record;
+};
+
+//the keys the input bytes choose from: letters the layouts remap, all modifiers, keys of bench/traces/rules.rules,
+//and keys that are never remapped
+#define CHECK_KEYS 32
+
+void check_init(struct check *check, const struct remap_config *config);
+//a key event of the keyboard in a frame of its own, value 2 is a repeat
+void check_key(struct check *check, int code, int value);
+//the kernel ran out of buffer space, the next check_key() ends the loss
+void check_dropped(struct check *check);
+//a key event after check_dropped() that only changes the state the kernel reports
+void check_lost(struct check *check, int code, int value);
+//no events for ms milliseconds, the timer of the event loop decides a pending tap-hold key
+void check_wait(struct check *check, int ms);
+//one input byte: the low bits choose a key that is pressed if it is up and released if it is down,
+//the high bits a repeat, a SYN_DROPPED, a lost event or a pause, or a tap of left alt for the toggle
+void check_op(struct check *check, unsigned int op);
+//releases all keys of the keyboard and checks that no output key is left pressed
+void check_finish(struct check *check);
+
+static inline bool check_down(const struct check *check, int code) {
+    return (check->kernel[code / (8 * sizeof(long))] >> (code % (8 * sizeof(long)))) & 1;
+}
+
+#endif
@@ -0,0 +1,91 @@
+/*
+ * Copyright 2018 Thomas Bocek
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ */
+
+/*
+ * Fuzz target
+ * ===========
+ *
+ * Every input byte is one action of a simulated keyboard, see check_op(), and every frame is
+ * checked by check.c. The first byte selects the configuration.
+ *
+ *   clang -g -O1 -fsanitize=fuzzer,address -DFUZZ_LIBFUZZER -I. bench/fuzz.c bench/check.c remap.c layout.c rules.c
+ *
+ * Without FUZZ_LIBFUZZER the inputs are read from the files on the command line, or from stdin,
+ * which is what AFL and a replay of a crash need.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "check.h"
+
+//the rules of the replay benchmark, relative to the repository
+#define FUZZ_RULES "bench/traces/rules.rules"
+
+static struct remap_config configs[4];
+static int n_configs = 0;
+
+static void init(void) {
+    const struct layout *layout = find_layout("dvorak");
+    const char *path = getenv("FUZZ_RULES") != NULL ? getenv("FUZZ_RULES") : FUZZ_RULES;
+    const struct rules *rules = rules_load(path);
+    remap_init(&configs[n_configs++], layout, NULL, false, false);
+    remap_init(&configs[n_configs++], layout, NULL, true, true);
+    remap_init(&configs[n_configs++], find_layout("colemak"), NULL, false, false);
+    if (rules != NULL) {
+        remap_init(&configs[n_configs++], layout, rules, false, false);
+    }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    static struct check check;
+    if (n_configs == 0) {
+        init();
+    }
+    if (size == 0) {
+        return 0;
+    }
+    check_init(&check, &configs[data[0] % n_configs]);
+    for (size_t i = 1; i < size; i++) {
+        check_op(&check, data[i]);
+    }
+    check_finish(&check);
+    return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+static int run_file(FILE *file) {
+    static uint8_t data[1 << 20];
+    size_t size = fread(data, 1, sizeof data, file);
+    return LLVMFuzzerTestOneInput(data, size);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        return run_file(stdin);
+    }
+    for (int i = 1; i < argc; i++) {
+        FILE *file = fopen(argv[i], "rb");
+        if (file == NULL) {
+            perror(argv[i]);
+            return EXIT_FAILURE;
+        }
+        run_file(file);
+        fclose(file);
+    }
+    return EXIT_SUCCESS;
+}
+#endif
@@ -0,0 +1,160 @@
+/*
+ * Copyright 2018 Thomas Bocek
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ */
+
+/*
+ * Stress test
+ * ===========
+ *
+ * Drives the remapping core with a random keyboard, checks every frame like the fuzzer,
+ * then replays the recorded input as fast as possible:
+ *
+ *   stress [-l LAYOUT] [-r RULES] [-n OPS] [-s SEED] [-t SECONDS]
+ *
+ * The replay processes the events the way read_device() does, with the fast path, and reports
+ * the sustained rate of the core without any I/O.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include "check.h"
+
+//most actions press or release a key, some repeat, tap left alt, or lose events
+static unsigned int random_op(uint64_t *seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+    unsigned int key = (unsigned int) (*seed >> 32) % CHECK_KEYS, roll = (unsigned int) (*seed >> 16) % 100;
+    unsigned int action = roll < 70 ? 0 : roll < 85 ? 4 : roll < 95 ? 7 : roll < 97 ? 5 : 6;
+    return action * CHECK_KEYS + key;
+}
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//one pass over the recording, in reads of at most 64 events like read_device()
+static size_t replay(const struct remap_config *config, const struct input_event *evs, size_t n) {
+    static struct out_buf out;
+    struct remap_state state = {0};
+    size_t emitted = 0;
+    for (size_t start = 0; start < n; start += 64) {
+        size_t count = n - start < 64 ? n - start : 64;
+        const struct input_event *batch = &evs[start];
+        for (size_t k = 0; k < count; k++) {
+            if (remap_idle(&state)) {
+                size_t pass = remap_passthrough(config, &state, &batch[k], count - k);
+                emitted += pass;
+                k += pass;
+                if (k == count) {
+                    break;
+                }
+            }
+            if (state.dropped) {
+                //the replay has no kernel state, release everything instead
+                static const unsigned long none[KEY_CNT / (8 * sizeof(long)) + 1];
+                static struct input_event sync[REMAP_RESYNC_MAX];
+                if (batch[k].type == EV_SYN && batch[k].code == SYN_REPORT) {
+                    size_t m = remap_resync(config, &state, none, batch[k].time, sync);
+                    for (size_t i = 0; i < m; i++) {
+                        if (out.len > OUT_MAX - REMAP_EVENT_MAX) {
+                            emitted += out.len;
+                            out.len = 0;
+                        }
+                        remap_event(config, &state, &sync[i], &out);
+                    }
+                }
+                continue;
+            }
+            if (out.len > OUT_MAX - REMAP_EVENT_MAX) {
+                emitted += out.len;
+                out.len = 0;
+            }
+            remap_event(config, &state, &batch[k], &out);
+        }
+        emitted += out.len;
+        out.len = 0;
+    }
+    return emitted;
+}
+
+int main(int argc, char *argv[]) {
+    const char *layout_name = "dvorak", *rules_path = NULL;
+    long ops = 2000000;
+    uint64_t seed = 0x9e3779b97f4a7c15ULL;
+    double seconds = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "l:r:n:s:t:")) != -1) {
+        switch (opt) {
+            case 'l':
+                layout_name = optarg;
+                break;
+            case 'r':
+                rules_path = optarg;
+                break;
+            case 'n':
+                ops = strtol(optarg, NULL, 10);
+                break;
+            case 's':
+                seed = strtoull(optarg, NULL, 0) | 1;
+                break;
+            case 't':
+                seconds = strtod(optarg, NULL);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-l LAYOUT] [-r RULES] [-n OPS] [-s SEED] [-t SECONDS]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    const struct layout *layout = find_layout(layout_name);
+    const struct rules *rules = NULL;
+    if (layout == NULL || (rules_path != NULL && (rules = rules_load(rules_path)) == NULL)) {
+        return EXIT_FAILURE;
+    }
+    struct remap_config config;
+    remap_init(&config, layout, rules, false, false);
+
+    static struct check check;
+    check_init(&check, &config);
+    check.max_record = 1 << 20;
+    check.record = malloc(check.max_record * sizeof *check.record);
+    if (check.record == NULL) {
+        return EXIT_FAILURE;
+    }
+    for (long i = 0; i < ops; i++) {
+        check_op(&check, random_op(&seed));
+    }
+    check_finish(&check);
+    printf("stress %-26s %9ld actions %10llu events in %10llu out, all checks passed\n", rules_path ? rules_path : "",
+           ops, (unsigned long long) check.events_in, (unsigned long long) check.events_out);
+
+    size_t emitted = 0;
+    long rounds = 0;
+    double start = now_s(), elapsed;
+    do {
+        emitted += replay(&config, check.record, check.n_record);
+        rounds++;
+    } while ((elapsed = now_s() - start) < seconds);
+    double rate = (double) check.n_record * rounds / elapsed;
+    printf("stress %-26s %9zu events %6.2f ns/event %8.2f Mevents/s sustained (%zu emitted)\n",
+           rules_path ? rules_path : "", check.n_record, 1e9 / rate, rate / 1e6, emitted / rounds);
+    free(check.record);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,291 @@
+/*
+ * Copyright 2018 Thomas Bocek
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ */
+
+/*
+ * Capability cloning
+ * ==================
+ *
+ * The virtual device needs the capabilities of the devices it replaces. Reading them costs one
+ * EVIOCGBIT per event type and one EVIOCGABS per axis, which adds up for composite receivers
+ * that are plugged in again and again. The result is therefore cached in CAPS_CACHE_DIR for each
+ * kind of device: bus, vendor, product, version, name, and interface. Setting them on uinput is
+ * one ioctl per capability, but empty words of the bitmaps are skipped.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <linux/uinput.h>
+#include "caps.h"
+#include "log.h"
+
+//tmpfs, a cache must not survive a reboot into a different kernel
+#define CAPS_CACHE_DIR "/run/dvorak"
+#define CAPS_CACHE_MAGIC 0x5350414356440001ULL
+
+struct caps_cache {
+    uint64_t magic;
+    struct caps caps;
+};
+
+static const struct caps_type {
+    const char *name;
+    int type,
+        max;
+    size_t offset;
+    unsigned long ui_set;
+} caps_types[] = {
+    { "EV_KEY", EV_KEY, KEY_MAX, offsetof(struct caps, key), UI_SET_KEYBIT },
+    { "EV_REL", EV_REL, REL_MAX, offsetof(struct caps, rel), UI_SET_RELBIT },
+    { "EV_ABS", EV_ABS, ABS_MAX, offsetof(struct caps, abs), UI_SET_ABSBIT },
+    { "EV_MSC", EV_MSC, MSC_MAX, offsetof(struct caps, msc), UI_SET_MSCBIT },
+    { "EV_SW", EV_SW, SW_MAX, offsetof(struct caps, sw), UI_SET_SWBIT },
+    { "EV_LED", EV_LED, LED_MAX, offsetof(struct caps, led), UI_SET_LEDBIT },
+    { "EV_SND", EV_SND, SND_MAX, offsetof(struct caps, snd), UI_SET_SNDBIT },
+};
+
+#define CAPS_TYPES (sizeof caps_types / sizeof caps_types[0])
+
+static unsigned int *type_bits(struct caps *caps, const struct caps_type *type) {
+    return (unsigned int *) ((char *) caps + type->offset);
+}
+
+static const unsigned int *const_type_bits(const struct caps *caps, const struct caps_type *type) {
+    return (const unsigned int *) ((const char *) caps + type->offset);
+}
+
+//interfaces of a composite device share the ids, so the name and the interface part of phys are part of the key
+static bool cache_path(int fd, const char *name, char *path, size_t len) {
+    struct input_id id;
+    if (ioctl(fd, EVIOCGID, &id) < 0) {
+        return false;
+    }
+    char phys[256] = "";
+    if (ioctl(fd, EVIOCGPHYS(sizeof phys - 1), phys) < 0) {
+        phys[0] = '\0';
+    }
+    const char *interface = strrchr(phys, '/');
+    interface = interface ? interface + 1 : "";
+
+    //FNV-1a over name and interface
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const char *p = name; *p; p++) {
+        hash = (hash ^ (unsigned char) *p) * 0x100000001b3ULL;
+    }
+    hash = (hash ^ '/') * 0x100000001b3ULL;
+    for (const char *p = interface; *p; p++) {
+        hash = (hash ^ (unsigned char) *p) * 0x100000001b3ULL;
+    }
+    return snprintf(path, len, CAPS_CACHE_DIR "/caps-%04x-%04x-%04x-%04x-%016llx",
+                    id.bustype, id.vendor, id.product, id.version, (unsigned long long) hash) < (int) len;
+}
+
+static bool read_cache(const char *path, struct caps *caps) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    static struct caps_cache cache;
+    bool ok = read(fd, &cache, sizeof cache) == sizeof cache && cache.magic == CAPS_CACHE_MAGIC;
+    close(fd);
+    if (ok) {
+        *caps = cache.caps;
+    }
+    return ok;
+}
+
+static void write_cache(const char *path, const struct caps *caps) {
+    static struct caps_cache cache;
+    cache.magic = CAPS_CACHE_MAGIC;
+    cache.caps = *caps;
+
+    if (mkdir(CAPS_CACHE_DIR, 0755) < 0 && errno != EEXIST) {
+        return;
+    }
+    char tmp_path[PATH_MAX + 16];
+    snprintf(tmp_path, sizeof tmp_path, "%s.%d", path, (int) getpid());
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return;
+    }
+    bool ok = write(fd, &cache, sizeof cache) == sizeof cache;
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(tmp_path, path) < 0) {
+        unlink(tmp_path);
+    }
+}
+
+bool caps_probe(int fd, const char *device, const char *name, struct caps *caps) {
+    char path[PATH_MAX];
+    bool cacheable = cache_path(fd, name, path, sizeof path);
+    if (cacheable && read_cache(path, caps)) {
+        return true;
+    }
+
+    memset(caps, 0, sizeof *caps);
+    if (ioctl(fd, EVIOCGBIT(0, sizeof caps->ev), caps->ev) < 0) {
+        log_printf(LOG_LEVEL_ERROR, "Error: Failed to retrieve event capabilities for device [%s]: %s.\n", device,
+                   strerror(errno));
+        return false;
+    }
+
+    for (size_t i = 0; i < CAPS_TYPES; i++) {
+        const struct caps_type *type = &caps_types[i];
+        if (!caps_has(caps->ev, type->type)) {
+            continue;
+        }
+        size_t len = (type->max / 32 + 1) * sizeof(unsigned int);
+        if (ioctl(fd, EVIOCGBIT(type->type, len), type_bits(caps, type)) < 0) {
+            log_printf(LOG_LEVEL_ERROR, "Error: Failed to retrieve %s capabilities for device [%s]: %s.\n",
+                    type->name, device, strerror(errno));
+            return false;
+        }
+    }
+
+    for (int i = 0; i < ABS_CNT; i++) {
+        if (caps_has(caps->abs, i) && ioctl(fd, EVIOCGABS(i), &caps->absinfo[i]) < 0) {
+            log_printf(LOG_LEVEL_ERROR, "Failed to get ABS info for axis %d: %s\n", i, strerror(errno));
+            caps->abs[i / 32] &= ~(1U << (i % 32));
+        }
+    }
+
+    if (cacheable) {
+        write_cache(path, caps);
+    }
+    return true;
+}
+
+void caps_merge(struct caps *dst, const struct caps *src) {
+    for (int i = 0; i < ABS_CNT; i++) {
+        if (caps_has(src->abs, i) && !caps_has(dst->abs, i)) {
+            dst->absinfo[i] = src->absinfo[i];
+        }
+    }
+    for (size_t i = 0; i < sizeof dst->ev / sizeof dst->ev[0]; i++) {
+        dst->ev[i] |= src->ev[i];
+    }
+    for (size_t i = 0; i < CAPS_TYPES; i++) {
+        unsigned int *bits = type_bits(dst, &caps_types[i]);
+        const unsigned int *src_bits = const_type_bits(src, &caps_types[i]);
+        for (int word = 0; word <= caps_types[i].max / 32; word++) {
+            bits[word] |= src_bits[word];
+        }
+    }
+}
+
+static void set_bit(unsigned int bits[], int code) {
+    bits[code / 32] |= 1U << (code % 32);
+}
+
+void caps_keyboard(struct caps *caps) {
+    set_bit(caps->ev, EV_SYN);
+    set_bit(caps->ev, EV_KEY);
+    set_bit(caps->ev, EV_MSC);
+    set_bit(caps->ev, EV_LED);
+    //buttons would make it look like a mouse or a joystick to libinput
+    for (int code = KEY_ESC; code < BTN_MISC; code++) {
+        set_bit(caps->key, code);
+    }
+    for (int code = KEY_OK; code < BTN_TRIGGER_HAPPY; code++) {
+        set_bit(caps->key, code);
+    }
+    set_bit(caps->msc, MSC_SCAN);
+    for (int code = LED_NUML; code <= LED_KANA; code++) {
+        set_bit(caps->led, code);
+    }
+}
+
+bool caps_subset(const struct caps *sub, const struct caps *caps) {
+    //EV_REP and EV_FF of the virtual device do not depend on the sources, see caps_setup()
+    unsigned int ev[EV_MAX/32 + 1];
+    memcpy(ev, sub->ev, sizeof ev);
+    ev[EV_REP / 32] &= ~(1U << (EV_REP % 32));
+    ev[EV_FF / 32] &= ~(1U << (EV_FF % 32));
+    for (size_t i = 0; i < sizeof ev / sizeof ev[0]; i++) {
+        if (ev[i] & ~caps->ev[i]) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < CAPS_TYPES; i++) {
+        const unsigned int *sub_bits = const_type_bits(sub, &caps_types[i]),
+                           *bits = const_type_bits(caps, &caps_types[i]);
+        for (int word = 0; word <= caps_types[i].max / 32; word++) {
+            if (sub_bits[word] & ~bits[word]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static bool setup_event_type(int fdo, const char *name, unsigned long ui_set, int max_val, const unsigned int array_bit[]) {
+    for (int word = 0; word <= max_val / 32; word++) {
+        if (array_bit[word] == 0) {
+            continue;
+        }
+        for (int i = word * 32; i < (word + 1) * 32 && i <= max_val; i++) {
+            if (caps_has(array_bit, i) && ioctl(fdo, ui_set, i) < 0) {
+                log_printf(LOG_LEVEL_ERROR, "Cannot set %s bit %d: %s\n", name, i, strerror(errno));
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool caps_setup(int fdo, const struct caps *caps, bool repeat) {
+    //With EV_REP, the kernel would repeat keys of the virtual device on top of the repeats that are
+    //forwarded from the source, unless repeat is off on the sources. EV_FF needs the effect uploads
+    //to be handled, keyboards do not use it.
+    unsigned int ev[EV_MAX/32 + 1];
+    memcpy(ev, caps->ev, sizeof ev);
+    ev[EV_REP / 32] &= ~(1U << (EV_REP % 32));
+    ev[EV_FF / 32] &= ~(1U << (EV_FF % 32));
+    if (repeat) {
+        ev[EV_REP / 32] |= 1U << (EV_REP % 32);
+    }
+
+    if (!setup_event_type(fdo, "EV", UI_SET_EVBIT, EV_MAX, ev)) {
+        return false;
+    }
+    for (size_t i = 0; i < CAPS_TYPES; i++) {
+        const struct caps_type *type = &caps_types[i];
+        if (caps_has(ev, type->type) &&
+            !setup_event_type(fdo, type->name + 3, type->ui_set, type->max, const_type_bits(caps, type))) {
+            return false;
+        }
+    }
+
+    for (int i = 0; i < ABS_CNT; i++) {
+        if (!caps_has(caps->abs, i)) {
+            continue;
+        }
+        struct uinput_abs_setup abs_setup = { .code = i, .absinfo = caps->absinfo[i] };
+        if (ioctl(fdo, UI_ABS_SETUP, &abs_setup) < 0) {
+            log_printf(LOG_LEVEL_ERROR, "Failed to setup ABS axis %d: %s\n", i, strerror(errno));
+            return false;
+        }
+    }
+    return true;
+}
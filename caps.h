@@ -0,0 +1,53 @@
+/*
+ * Copyright 2018 Thomas Bocek
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ */
+
+#ifndef CAPS_H
+#define CAPS_H
+
+#include <stdbool.h>
+#include <linux/input.h>
+
+//the event types and codes a device supports, one bit per code as returned by EVIOCGBIT
+struct caps {
+    unsigned int
+        ev[EV_MAX/32 + 1],
+        key[KEY_MAX/32 + 1],
+        rel[REL_MAX/32 + 1],
+        abs[ABS_MAX/32 + 1],
+        msc[MSC_MAX/32 + 1],
+        sw[SW_MAX/32 + 1],
+        led[LED_MAX/32 + 1],
+        snd[SND_MAX/32 + 1];
+    struct input_absinfo absinfo[ABS_CNT];
+};
+
+static inline bool caps_has(const unsigned int bits[], int code) {
+    return (bits[code / 32] & (1U << (code % 32))) != 0;
+}
+
+//reads the capabilities of an input device, or takes them from the cache if this kind of device was seen before
+bool caps_probe(int fd, const char *device, const char *name, struct caps *caps);
+//adds the capabilities of src to dst, axes that dst already has keep their range
+void caps_merge(struct caps *dst, const struct caps *src);
+//adds the keys, scan codes, and LEDs of any keyboard, so a keyboard plugged in later fits into the same virtual device
+void caps_keyboard(struct caps *caps);
+//true if caps has every event type and code of sub
+bool caps_subset(const struct caps *sub, const struct caps *caps);
+//sets the capabilities on a uinput device before UI_DEV_CREATE, with repeat the kernel repeats its keys
+bool caps_setup(int fdo, const struct caps *caps, bool repeat);
+
+#endif
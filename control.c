@@ -0,0 +1,97 @@
+/*
+ * Copyright 2018 Thomas Bocek
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ */
+
+/*
+ * Control socket
+ * ==============
+ *
+ * With --control PATH a unix datagram socket is bound at PATH. Every datagram is either
+ * "reload", which reads the config file again, or lines in the format of the config file:
+ *
+ *   echo "layout colemak" | socat - UNIX-SENDTO:/run/dvorak/control
+ *
+ * "focus APP" comes from a helper of the compositor when the focused application changes,
+ * and selects the profile of APP from the config, or the config itself if APP has none.
+ * Anyone can write to the socket, so that the helper runs as the user of the session. The
+ * kernel attaches the credentials of the sender to every datagram, and only "focus" is
+ * accepted from a sender that is not root.
+ *
+ * A datagram is always one complete message, so no framing or connection state is needed.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "control.h"
+
+int control_open(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof addr.sun_path) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int on = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof on) < 0) {
+        close(fd);
+        return -1;
+    }
+    //a socket left behind by an earlier instance
+    unlink(path);
+    mode_t mask = umask(0111);
+    int ret_val = bind(fd, (struct sockaddr *) &addr, sizeof addr);
+    umask(mask);
+    if (ret_val < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+ssize_t control_receive(int fd, char *buf, size_t size, uid_t *uid) {
+    struct iovec iov = { .iov_base = buf, .iov_len = size - 1 };
+    union {
+        char buf[CMSG_SPACE(sizeof(struct ucred))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf,
+                          .msg_controllen = sizeof control.buf };
+    ssize_t n = recvmsg(fd, &msg, 0);
+    if (n < 0) {
+        return -1;
+    }
+    buf[n] = '\0';
+    //without credentials the sender is treated as unprivileged
+    *uid = (uid_t) -1;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_CREDENTIALS) {
+            struct ucred cred;
+            memcpy(&cred, CMSG_DATA(cmsg), sizeof cred);
+            *uid = cred.uid;
+        }
+    }
+    return n;
+}
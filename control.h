@@ -0,0 +1,32 @@
+/*
+ * Copyright 2018 Thomas Bocek
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ */
+
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+//largest message on the control socket
+#define CONTROL_MAX 4096
+
+//binds a datagram socket at path that everyone can write to, -1 on error
+int control_open(const char *path);
+//receives one message as a string and the uid of its sender, -1 if there is none
+ssize_t control_receive(int fd, char *buf, size_t size, uid_t *uid);
+
+#endif
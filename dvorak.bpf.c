@@ -0,0 +1,129 @@
+/*
+ * Copyright 2018 Thomas Bocek
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ */
+
+/*
+ * In-kernel remapping with HID-BPF
+ * ================================
+ *
+ * This program is attached to the HID device behind a keyboard (struct_ops, Linux 6.11 or
+ * newer) and rewrites its boot protocol reports before hid-input turns them into evdev
+ * events. Nothing is grabbed and nothing goes through userspace or /dev/uinput: a report
+ *
+ *   byte 0: modifier bits, byte 1: reserved, bytes 2-7: HID usages of the pressed keys
+ *
+ * gets its usages replaced with usage_map[] while ctrl, alt, win, or caps lock is held. It
+ * follows remap_event() in remap.c: a key keeps the mapping it was pressed with until it
+ * is released, and three left alt taps toggle the mapping. The loader in hidbpf.c fills in
+ * the read-only section before the program is loaded, it is built with make HID_BPF=1.
+ *
+ * The kernel only exports the HID-BPF kfuncs to GPL programs, so this file is also
+ * available under the GPL-2.0.
+ */
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_tracing.h>
+
+#define BOOT_REPORT_SIZE 8
+#define BOOT_KEYS 6
+#define USAGE_CAPSLOCK 0x39
+//the first usages are error codes (rollover, POST fail, undefined), not keys
+#define USAGE_FIRST_KEY 0x04
+//left ctrl, left alt, left win, right ctrl, same as remap_modifier_bits
+#define MOD_REMAP 0x1d
+#define MOD_LEFTALT 0x04
+
+extern __u8 *hid_bpf_get_data(struct hid_bpf_ctx *ctx, unsigned int offset, const size_t sz) __ksym;
+
+//set by the loader
+const volatile __u8 usage_map[256];
+const volatile bool caps_lock_modifier = true;
+const volatile bool toggle = true;
+
+//one instance of this program is loaded per device, so the state is per device as well
+static __u8 prev_report[BOOT_REPORT_SIZE];
+//usages that were pressed with a modifier and are still held
+static __u8 remapped[256 / 8];
+static int l_alt;
+static bool disable_mapping;
+
+static bool has_key(const __u8 *report, __u8 usage) {
+    for (int i = 2; i < BOOT_REPORT_SIZE; i++) {
+        if (report[i] == usage) {
+            return true;
+        }
+    }
+    return false;
+}
+
+SEC("struct_ops/hid_device_event")
+int BPF_PROG(dvorak_event, struct hid_bpf_ctx *hctx, enum hid_report_type type, __u64 source) {
+    __u8 *data = hid_bpf_get_data(hctx, 0, BOOT_REPORT_SIZE);
+    if (data == NULL || hctx->size != BOOT_REPORT_SIZE) {
+        return 0;
+    }
+    __u8 report[BOOT_REPORT_SIZE];
+    __builtin_memcpy(report, data, BOOT_REPORT_SIZE);
+
+    //three left alt presses in a row, with no other change in between, toggle the mapping
+    if (toggle) {
+        __u8 mods = report[0], prev_mods = prev_report[0];
+        bool keys_changed = false;
+        for (int i = 2; i < BOOT_REPORT_SIZE; i++) {
+            keys_changed |= report[i] != prev_report[i];
+        }
+        if (keys_changed || ((mods ^ prev_mods) & ~MOD_LEFTALT)) {
+            l_alt = 0;
+        } else if ((mods & MOD_LEFTALT) && !(prev_mods & MOD_LEFTALT) && ++l_alt >= 3) {
+            disable_mapping = !disable_mapping;
+            l_alt = 0;
+        }
+    }
+
+    bool modifier = (report[0] & MOD_REMAP) || (caps_lock_modifier && has_key(report, USAGE_CAPSLOCK));
+    __u8 held[256 / 8] = {0};
+    for (int i = 2; i < BOOT_REPORT_SIZE; i++) {
+        __u8 usage = report[i];
+        if (usage < USAGE_FIRST_KEY) {
+            continue;
+        }
+        __u8 bit = 1 << (usage % 8);
+        bool remap;
+        if (has_key(prev_report, usage)) {
+            //held or repeating, keep what it was pressed with
+            remap = remapped[usage / 8] & bit;
+        } else {
+            remap = modifier && !disable_mapping;
+        }
+        if (remap) {
+            held[usage / 8] |= bit;
+            data[i] = usage_map[usage];
+        }
+    }
+
+    //a key that is missing from the report was released, so it drops out of remapped
+    __builtin_memcpy(remapped, held, sizeof remapped);
+    //the previous report is kept as it came from the device
+    __builtin_memcpy(prev_report, report, BOOT_REPORT_SIZE);
+    return 0;
+}
+
+SEC(".struct_ops.link")
+struct hid_bpf_ops dvorak = {
+    .hid_device_event = (void *) dvorak_event,
+};
+
+char _license[] SEC("license") = "GPL";
@@ -61,6 +61,7 @@
  * https://gist.github.com/toinsson/7e9fdd3c908b3c3d3cd635321d19d44d
  *
  */
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -70,184 +71,1395 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <signal.h>
+#include <dirent.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <time.h>
+#include <limits.h>
+#include <getopt.h>
+#include "layout.h"
+#include "remap.h"
+#include "uevent.h"
+#include "caps.h"
+#include "latency.h"
+#include "realtime.h"
+#include "hidbpf.h"
+#include "settings.h"
+#include "control.h"
+#include "log.h"
+#include "stats.h"
+#include "uring.h"
+#include "probe.h"
+#include "output.h"
 
-//a key combination has a maximum amount of 8 characters. That should be enough.
-#define MAX_LENGTH 8
+//number of events fetched with one read(), a burst of key presses fits easily
+#define EVENT_BATCH 64
+//upper limit for --read-batch, a barcode scanner sends a few hundred events at once
+#define EVENT_BATCH_MAX 1024
+//number of input devices one process can capture
+#define MAX_DEVICES 64
+//how long to wait for udev to announce the virtual device before grabbing anyway
+#define READY_TIMEOUT_MS 200
+//how long a key that is held at startup may delay the grab
+#define RELEASE_TIMEOUT_MS 1000
 
-static int fdi;
+//the autorepeat the kernel uses when a driver does not set one
+#define REPEAT_DELAY_MS 250
+#define REPEAT_PERIOD_MS 33
+
+enum { DEVICE_ERROR = -1, DEVICE_SKIP = 0, DEVICE_OK = 1 };
+
+//every captured device keeps track of its own modifiers and remapped keys
+struct device {
+    int fd;
+    char path[PATH_MAX];
+    char name[UINPUT_MAX_NAME_SIZE];
+    //the device has LEDs or a speaker, their state is forwarded from the virtual device
+    bool feedback;
+    struct latency latency;
+    struct remap_state state;
+    //the device is remapped in the kernel and not grabbed, its events are only drained
+    struct hidbpf *bpf;
+    //taken in start_device(), the loop only adds to it
+    struct device_stats *stats;
+    //delay and period of the kernel autorepeat, restored on close if repeat_off
+    unsigned int rep[2];
+    bool has_rep,
+         repeat_off;
+    //the device is gone and its path is watched until then, 0 if it is not waiting to come back
+    long long reattach_deadline;
+    //ID_SEAT of udev, the virtual device goes to the same seat
+    char seat[UEVENT_SEAT_MAX];
+    //with --io-uring a read into buf stays submitted while reading, rearm submits it again with the next round
+    struct input_event *buf;
+    bool reading,
+         rearm;
+    //counts the devices the slot held, a read of an earlier one must not reach this one
+    uint32_t generation;
+    //the read completed while drain_writes() waited, reap() handles it
+    bool has_deferred;
+    struct io_uring_cqe deferred;
+};
+
+static struct uinput_setup usetup =
+        { .id =
+            { .bustype = BUS_USB, .vendor = 0x1111, .product = 0x2222 },
+          .name = "Virtual Dvorak Keyboard" };
+static bool measureLatency = false,
+            hidBpf = false,
+            shared = false,
+            repeatVirtual = false;
+//events per read() of a source device
+static int readBatch = EVENT_BATCH;
+//how long a device that is gone may take to come back with the same path, 0 to exit instead
+static int reattachMs = 0;
+//the clock of the event timestamps, set on every source device with EVIOCSCLOCKID if clockSet
+static clockid_t eventClock = CLOCK_REALTIME;
+static bool clockSet = false;
+//with --seat only keyboards of this seat are grabbed, one process per seat
+static const char *seatName = NULL;
+//--probe: a tagged frame is written every probeMs, for dvorak-probe
+static int probeMs = 0;
+static long long probe_next = 0;
+static unsigned int probe_count = 0;
+static struct device_stats probe_stats;
+//--writer-thread: the frames are written by the thread of output.c
+static bool writerThread = false,
+            writerStarted = false;
+
+//epoll_wait() is never restarted, so a signal always ends the event loop
 static volatile sig_atomic_t keep_running = 1;
 static void sig_handler() {
     keep_running = 0;
-    close(fdi);
-}
-
-//from: https://github.com/kentonv/dvorak-qwerty/tree/master/unix
-static int modifier_bit(int key) {
-    switch (key) {
-        case KEY_LEFTCTRL:
-            return 1;
-        case KEY_RIGHTCTRL:
-            return 2;
-        case KEY_LEFTALT:
-            return 4;
-        case KEY_LEFTMETA:
-            return 8;
-        case KEY_CAPSLOCK:
-            return 16;
-        default:
-            return 0;
-    }
-}
-
-//from: https://github.com/kentonv/dvorak-qwerty/tree/master/unix
-static int qwerty2dvorak(int key) {
-    switch (key) {
-        case KEY_MINUS:
-            return KEY_APOSTROPHE;
-        case KEY_EQUAL:
-            return KEY_RIGHTBRACE;
-        case KEY_Q:
-            return KEY_X;
-        case KEY_W:
-            return KEY_COMMA;
-        case KEY_E:
-            return KEY_D;
-        case KEY_R:
-            return KEY_O;
-        case KEY_T:
-            return KEY_K;
-        case KEY_Y:
-            return KEY_T;
-        case KEY_U:
-            return KEY_F;
-        case KEY_I:
-            return KEY_G;
-        case KEY_O:
-            return KEY_S;
-        case KEY_P:
-            return KEY_R;
-        case KEY_LEFTBRACE:
-            return KEY_MINUS;
-        case KEY_RIGHTBRACE:
-            return KEY_EQUAL;
-        case KEY_A:
-            return KEY_A;
-        case KEY_S:
-            return KEY_SEMICOLON;
-        case KEY_D:
-            return KEY_H;
-        case KEY_F:
-            return KEY_Y;
-        case KEY_G:
-            return KEY_U;
-        case KEY_H:
-            return KEY_J;
-        case KEY_J:
-            return KEY_C;
-        case KEY_K:
-            return KEY_V;
-        case KEY_L:
-            return KEY_P;
-        case KEY_SEMICOLON:
-            return KEY_Z;
-        case KEY_APOSTROPHE:
-            return KEY_Q;
-        case KEY_Z:
-            return KEY_SLASH;
-        case KEY_X:
-            return KEY_B;
-        case KEY_C:
-            return KEY_I;
-        case KEY_V:
-            return KEY_DOT;
-        case KEY_B:
-            return KEY_N;
-        case KEY_N:
-            return KEY_L;
-        case KEY_M:
-            return KEY_M;
-        case KEY_COMMA:
-            return KEY_W;
-        case KEY_DOT:
-            return KEY_E;
-        case KEY_SLASH:
-            return KEY_LEFTBRACE;
-        default:
-            return key;
-    }
-}
-
-static ssize_t emit(int fd, int type, int code, int value, struct timeval time) {
-    struct input_event ev = {0};
-    ev.type = type;
-    ev.code = code;
-    ev.value = value;
-    ev.time = time;
-    //fprintf(stdout, "Emit event type=%d code=%d value=%d\n",ev.type, ev.code, ev.value);
-    return write(fd, &ev, sizeof(ev));
-}
-
-static bool has_event_type(const unsigned int array_bit_ev[], int event_type) {
-    return (array_bit_ev[event_type/32] & (1U << (event_type % 32))) != 0;
-}
-
-static bool setup_event_type(int fdo, unsigned long event_type, int max_val, const unsigned int array_bit[]) {
-    struct uinput_abs_setup abs_setup = {};
-    bool abs_init_once = false;
-
-    for (int i = 0; i < max_val; i++) {
-        if (!(array_bit[i / 32] & (1U << (i % 32)))) {
+}
+
+static volatile sig_atomic_t report_latency = 0;
+static void report_handler() {
+    report_latency = 1;
+}
+
+//SIGHUP reads the config file again
+static volatile sig_atomic_t reload_config = 0;
+static void reload_handler() {
+    reload_config = 1;
+}
+
+static struct remap_config config;
+
+//the command line overrides the config file, settings is what config was built from
+static struct settings cli_settings, settings;
+static const char *configPath = NULL;
+//a new configuration waits here until no key is held on any keyboard, see apply_pending()
+static struct remap_config pending;
+static bool has_pending = false;
+
+//the profiles of settings, compiled in prepare_settings() like config
+struct profile {
+    char app[SETTINGS_APP_MAX];
+    struct remap_config config;
+    //the layout is not the one of the config it was compiled from
+    bool own_layout;
+};
+static struct profile profiles[SETTINGS_PROFILES],
+                      pending_profiles[SETTINGS_PROFILES];
+static int n_profiles = 0,
+           n_pending_profiles = 0;
+//what every keyboard is remapped with, &config or the config of the focused profile. A focus change is
+//a new pointer that waits in focus_next until the keyboards are idle, see apply_focus().
+static const struct remap_config *current = &config,
+                                 *focus_next = NULL;
+static char focused[SETTINGS_APP_MAX] = "";
+//received from epoll with data.ptr == &control_fd
+static int control_fd = -1;
+//the udev monitor stays open in shared mode to pick up keyboards that are plugged in, data.ptr == &hotplug_fd
+static int hotplug_fd = -1;
+//watches the directories of the devices with --reattach, data.ptr == &inotify_fd
+static int inotify_fd = -1;
+//on the event clock, fires when the earliest tap-hold key that is not decided yet becomes held,
+//data.ptr == &timer_fd. timer_deadline is what it is armed with, 0 if it is not.
+static int timer_fd = -1;
+static long long timer_deadline = 0;
+
+//--io-uring: the reads of all devices stay submitted, data.ptr == &ring is a poll on the epoll fd for everything
+//else. The writes of one round are copied to stage and hard-linked in order, so they go out with the same
+//io_uring_enter() that waits for the next completion. Freed in stage once no write is in flight.
+static struct uring ring = { .fd = -1 };
+static bool ioUring = false,
+            ioUringPoll = false,
+            pollMultishot = true;
+#define STAGE_MAX 4096
+static struct input_event stage[STAGE_MAX];
+static size_t stage_len = 0;
+static unsigned writes_in_flight = 0;
+//a write names its entry here, every one has at least one event in stage, so there are at most as many
+struct staged_write {
+    struct device_stats *stats;
+    //NULL without -L
+    struct latency *latency;
+    size_t start;
+};
+static struct staged_write staged[STAGE_MAX];
+static unsigned n_staged = 0;
+//in the low bits of user_data, above them a write has its index in staged
+enum { TAG_NONE, TAG_READ, TAG_WRITE, TAG_POLL, TAG_MASK = 7 };
+//the slots of the devices, a read carries its slot and the generation of the device in it
+static struct device *uring_devices;
+
+static uint64_t read_tag(const struct device *dev) {
+    return (uint64_t) (dev - uring_devices) << 32 | (uint64_t) (dev->generation & 0x1fffffff) << 3 | TAG_READ;
+}
+//completions of other operations that came in while waiting for the writes, see drain_writes(). Only one
+//read per device and the poll are live, so a device and the poll each keep the last one.
+static struct io_uring_cqe poll_deferred;
+static bool has_poll_deferred = false,
+            reads_deferred = false;
+
+//devices whose read is submitted with the next round
+static struct device *rearm_list[MAX_DEVICES];
+static int n_rearm = 0;
+
+//with -L and --writer-thread or --io-uring, the histogram of the device whose events are written. Their
+//frames are measured once the write is done, not when they are queued.
+static struct latency *frame_latency = NULL;
+
+static ssize_t queue_events(int fd, const struct input_event *evs, size_t n, struct device_stats *stats);
+
+static ssize_t write_events(int fd, const struct input_event *evs, size_t n, struct device_stats *stats) {
+    if (writerStarted) {
+        //a frame that does not fit is counted as lost, output_resync() releases what may be stuck
+        if (!output_push(evs, n, frame_latency)) {
+            stats_add(&stats->write_errors, 1);
+            return -1;
+        }
+        stats_add(&stats->events_emitted, n);
+        stats_add(&stats->bytes_written, n * sizeof *evs);
+        return n * sizeof *evs;
+    }
+    if (ring.fd >= 0) {
+        return queue_events(fd, evs, n, stats);
+    }
+    //uinput is O_NONBLOCK, a busy reader gets a moment before the events are lost
+    ssize_t written = output_write(fd, evs, n, OUTPUT_RETRY_MS);
+    if (written != (ssize_t) (n * sizeof *evs)) {
+        stats_add(&stats->write_errors, 1);
+    }
+    if (written > 0) {
+        stats_add(&stats->events_emitted, written / sizeof *evs);
+        stats_add(&stats->bytes_written, written);
+    }
+    return written;
+}
+
+static ssize_t flush(int fd, struct out_buf *out, struct device_stats *stats) {
+    if (out->len == 0) {
+        return 0;
+    }
+    ssize_t n = write_events(fd, out->ev, out->len, stats);
+    out->len = 0;
+    return n;
+}
+
+//all devices feed the same virtual device, a frame is flushed before the next device is read
+static struct out_buf out;
+
+//true if there is no match, or the name contains one of its space separated keywords
+static bool match_device(const char *name, const char *match) {
+    if (match == NULL) {
+        return true;
+    }
+    //strtok modifies its input and the keywords are needed for every device
+    char *words = strdup(match), *save = NULL;
+    bool found = false;
+    for (char *token = strtok_r(words, " ", &save); token != NULL && !found; token = strtok_r(NULL, " ", &save)) {
+        found = strcasestr(name, token) != NULL;
+    }
+    free(words);
+    return found;
+}
+
+static const char *settings_match(const struct settings *s) {
+    return s->has_match && s->match[0] != '\0' ? s->match : NULL;
+}
+
+//returns DEVICE_OK if dev is ready to be grabbed, its capabilities are added to caps
+static int open_device(struct device *dev, const char *device, const char *match, struct caps *caps) {
+    //Start the fdi setup, writing is only needed to forward the LED state
+    int fdi = open(device, O_RDWR | O_NONBLOCK);
+    if (fdi < 0 && errno == EACCES) {
+        fdi = open(device, O_RDONLY | O_NONBLOCK);
+    }
+    if (fdi < 0) {
+        log_printf(LOG_LEVEL_ERROR, "Error: Failed to open device [%s]: %s.\n", device, strerror(errno));
+        log_printf(LOG_LEVEL_ERROR, "Hint: Check if the device path is correct and you have the necessary permissions.\n");
+        return DEVICE_ERROR;
+    }
+
+    char keyboard_name[UINPUT_MAX_NAME_SIZE] = "Unknown";
+    int ret_val = ioctl(fdi, EVIOCGNAME(sizeof(keyboard_name) - 1), keyboard_name);
+    if (ret_val < 0) {
+        log_printf(LOG_LEVEL_ERROR, "Error: Unable to retrieve device name for [%s]: %s.\n", device, strerror(errno));
+        log_printf(LOG_LEVEL_ERROR, "Hint: Verify if the device is functional and properly configured.\n");
+        close(fdi);
+        return DEVICE_ERROR;
+    }
+
+    if (strcmp(keyboard_name, usetup.name) == 0) {
+        log_printf(LOG_LEVEL_DEBUG, "Info: Skipping mapping for the device we just created: %s.\n", keyboard_name);
+        close(fdi);
+        return DEVICE_SKIP;
+    }
+
+    if (!match_device(keyboard_name, match)) {
+        log_printf(LOG_LEVEL_ERROR, "Error: Device [%s] does not match any of the specified keywords: [%s].\n", keyboard_name, match);
+        close(fdi);
+        return DEVICE_ERROR;
+    }
+    char seat[UEVENT_SEAT_MAX] = "seat0";
+    struct stat st;
+    if (fstat(fdi, &st) == 0) {
+        uevent_seat(st.st_rdev, seat, sizeof seat);
+    }
+    if (seatName != NULL && strcmp(seat, seatName) != 0) {
+        log_printf(LOG_LEVEL_DEBUG, "Info: Device [%s] is on seat [%s], not on [%s].\n", device, seat, seatName);
+        close(fdi);
+        return DEVICE_SKIP;
+    }
+    if (match != NULL) {
+        log_printf(LOG_LEVEL_INFO, "Info: Found matching input: [%s] for device [%s].\n", keyboard_name, device);
+    }
+
+    //the kernel stamps events with CLOCK_REALTIME by default, which can jump
+    if (clockSet) {
+        int clock_id = eventClock;
+        if (ioctl(fdi, EVIOCSCLOCKID, &clock_id) < 0) {
+            log_printf(LOG_LEVEL_INFO, "Info: Cannot switch the clock of device [%s]: %s.\n", device, strerror(errno));
+        }
+    }
+
+    struct caps dev_caps;
+    if (!caps_probe(fdi, device, keyboard_name, &dev_caps)) {
+        close(fdi);
+        return DEVICE_ERROR;
+    }
+
+    //Check we are a keyboard
+    if (!caps_has(dev_caps.key, KEY_X) || !caps_has(dev_caps.key, KEY_C) || !caps_has(dev_caps.key, KEY_V)) {
+        log_printf(LOG_LEVEL_DEBUG, "Info: Device [%s] is not recognized as a keyboard (missing essential keys).\n", device);
+        close(fdi);
+        return DEVICE_SKIP;
+    }
+    caps_merge(caps, &dev_caps);
+
+    //the read buffer of --io-uring and the generation belong to the slot
+    struct input_event *buf = dev->buf;
+    uint32_t generation = dev->generation;
+    memset(dev, 0, sizeof *dev);
+    dev->buf = buf;
+    dev->generation = generation;
+    dev->fd = fdi;
+    snprintf(dev->path, sizeof dev->path, "%s", device);
+    dev->feedback = caps_has(dev_caps.ev, EV_LED) || caps_has(dev_caps.ev, EV_SND);
+    dev->has_rep = caps_has(dev_caps.ev, EV_REP) && ioctl(fdi, EVIOCGREP, dev->rep) >= 0;
+    //an instance that did not exit cleanly left the repeat off, restore the kernel default
+    if (repeatVirtual && dev->has_rep && dev->rep[1] == 0) {
+        dev->rep[0] = REPEAT_DELAY_MS;
+        dev->rep[1] = REPEAT_PERIOD_MS;
+    }
+    strcpy(dev->name, keyboard_name);
+    strcpy(dev->seat, seat);
+    return DEVICE_OK;
+}
+
+//collects the event nodes in /dev/input, anything that is not a keyboard is skipped by open_device
+static int discover_devices(const char *paths[], int max) {
+    DIR *dir = opendir("/dev/input");
+    if (dir == NULL) {
+        fprintf(stderr, "Error: Cannot list /dev/input: %s.\n", strerror(errno));
+        return 0;
+    }
+    int n = 0;
+    struct dirent *entry;
+    while (n < max && (entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "event", 5) != 0) {
+            continue;
+        }
+        char *path;
+        if (asprintf(&path, "/dev/input/%s", entry->d_name) < 0) {
+            break;
+        }
+        paths[n++] = path;
+    }
+    closedir(dir);
+    return n;
+}
+
+static void record_frame(struct latency *latency, const struct input_event *ev, const struct timespec *now) {
+    int64_t ns = (now->tv_sec - ev->time.tv_sec) * 1000000000LL + now->tv_nsec - ev->time.tv_usec * 1000LL;
+    latency_record(latency, ns > 0 ? ns : 0);
+}
+
+//the frame that ends with ev has been written, unless the writes are queued, see frame_latency
+static void record_latency(struct device *dev, const struct input_event *ev) {
+    if (frame_latency != NULL) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(eventClock, &now);
+    record_frame(&dev->latency, ev, &now);
+}
+
+//with -L, the frames among the n events that were written
+static void record_written(struct latency *latency, const struct input_event *evs, size_t n) {
+    if (latency == NULL) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(eventClock, &now);
+    for (size_t i = 0; i < n; i++) {
+        if (evs[i].type == EV_SYN && evs[i].code == SYN_REPORT) {
+            record_frame(latency, &evs[i], &now);
+        }
+    }
+}
+
+//presses or releases every key whose state differs from keys in one batch, returns the number of keys
+static size_t sync_keys(int fdo, struct device *dev, const unsigned long keys[], struct timeval time) {
+    static struct input_event sync[REMAP_RESYNC_MAX];
+    size_t n = remap_resync(current, &dev->state, keys, time, sync);
+    for (size_t i = 0; i < n; i++) {
+        if (out.len > OUT_MAX - REMAP_EVENT_MAX) {
+            flush(fdo, &out, dev->stats);
+        }
+        remap_event(current, &dev->state, &sync[i], &out);
+    }
+    flush(fdo, &out, dev->stats);
+    return n - 1;
+}
+
+//the kernel dropped events, the keys that changed in the meantime are pressed or released in one batch
+static void resync_device(int fdo, struct device *dev, struct timeval time) {
+    unsigned long keys[KEY_CNT / (8 * sizeof(long)) + 1] = {0};
+    if (ioctl(dev->fd, EVIOCGKEY(sizeof keys), keys) < 0) {
+        //without the real state, releasing everything is the only way to not leave a key stuck
+        memset(keys, 0, sizeof keys);
+    }
+    size_t n = sync_keys(fdo, dev, keys, time);
+    stats_add(&dev->stats->dropped, 1);
+    log_printf(LOG_LEVEL_INFO, "Info: Events of device [%s] were dropped, %zu keys changed.\n", dev->path, n);
+}
+
+//remaps the n bytes of one read of the device, returns false once the device is gone
+static bool handle_events(int fdo, struct device *dev, const struct input_event *evs, ssize_t n) {
+    if (n < (ssize_t) sizeof *evs || n % sizeof *evs != 0) {
+        stats_add(&dev->stats->read_errors, 1);
+        return false;
+    }
+    size_t count = n / sizeof *evs;
+    stats_add(&dev->stats->events_read, count);
+    if (dev->bpf != NULL) {
+        //already remapped by the kernel, and not grabbed
+        return true;
+    }
+
+    frame_latency = measureLatency && (writerStarted || ring.fd >= 0) ? &dev->latency : NULL;
+    for (size_t k = 0; k < count; k++) {
+        //plain typing: everything up to the next modifier edge is written as it was read
+        if (remap_idle(&dev->state)) {
+            size_t pass = remap_passthrough(current, &dev->state, &evs[k], count - k);
+            if (pass > 0) {
+                flush(fdo, &out, dev->stats);
+                write_events(fdo, &evs[k], pass, dev->stats);
+                for (size_t i = k; i < k + pass; i++) {
+                    if (evs[i].type == EV_KEY && evs[i].value == 2) {
+                        stats_add(&dev->stats->repeats, 1);
+                    } else if (measureLatency && evs[i].type == EV_SYN && evs[i].code == SYN_REPORT) {
+                        record_latency(dev, &evs[i]);
+                    }
+                }
+                k += pass;
+                if (k == count) {
+                    break;
+                }
+            }
+        }
+
+        if (dev->state.dropped) {
+            if (evs[k].type == EV_SYN && evs[k].code == SYN_REPORT) {
+                resync_device(fdo, dev, evs[k].time);
+            }
+            continue;
+        }
+        if (out.len > OUT_MAX - REMAP_EVENT_MAX) {
+            flush(fdo, &out, dev->stats);
+            stats_add(&dev->stats->overflows, 1);
+        }
+        bool disabled = dev->state.disable_mapping;
+        remap_event(current, &dev->state, &evs[k], &out);
+        if (disabled != dev->state.disable_mapping) {
+            stats_add(&dev->stats->toggles, 1);
+            log_printf(LOG_LEVEL_INFO, "mapping is set to [%s]\n", !dev->state.disable_mapping ? "true" : "false");
+        }
+        if (evs[k].type == EV_KEY && evs[k].value == 1 && evs[k].code < LAYOUT_KEYS &&
+            remap_held(&dev->state, evs[k].code)) {
+            stats_add(&dev->stats->remapped, 1);
+        } else if (evs[k].type == EV_KEY && evs[k].value == 2) {
+            stats_add(&dev->stats->repeats, 1);
+        }
+        if (evs[k].type == EV_SYN && evs[k].code == SYN_REPORT) {
+            flush(fdo, &out, dev->stats);
+            if (measureLatency) {
+                record_latency(dev, &evs[k]);
+            }
+        }
+    }
+    //a read can end in the middle of a frame, do not hold back what we have
+    flush(fdo, &out, dev->stats);
+    frame_latency = NULL;
+    return true;
+}
+
+//reads all pending events of a device, returns false once the device is gone
+static bool read_device(int fdo, struct device *dev) {
+    static struct input_event evs[EVENT_BATCH_MAX];
+    ssize_t n = read(dev->fd, evs, readBatch * sizeof *evs);
+    if (n == (ssize_t) -1) {
+        if (errno == EINTR || errno == EAGAIN) {
+            return true;
+        }
+        stats_add(&dev->stats->read_errors, 1);
+        return false;
+    }
+    return handle_events(fdo, dev, evs, n);
+}
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+//checks sysfs for the event node of the virtual device, used when udev is not running
+static bool event_node_exists(const char *sysname) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof path, "/sys/devices/virtual/input/%s", sysname);
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return false;
+    }
+    bool found = false;
+    struct dirent *entry;
+    while (!found && (entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "event", 5) == 0) {
+            snprintf(path, sizeof path, "/dev/input/%s", entry->d_name);
+            found = access(path, F_OK) == 0;
+        }
+    }
+    closedir(dir);
+    return found;
+}
+
+//waits until udev announced the virtual device, or its node exists if there is no udev. The udev
+//monitor has to be opened before the device is created, otherwise the add event may be missed.
+static void wait_device_ready(int fdo, int uevent_fd) {
+    char sysname[64], devpath[80];
+    if (ioctl(fdo, UI_GET_SYSNAME(sizeof sysname), sysname) < 0) {
+        usleep(READY_TIMEOUT_MS * 1000);
+        return;
+    }
+    snprintf(devpath, sizeof devpath, "/%s/event", sysname);
+
+    static struct uevent event;
+    long long deadline = now_ms() + READY_TIMEOUT_MS;
+    for (long long left = READY_TIMEOUT_MS; left > 0; left = deadline - now_ms()) {
+        if (uevent_fd < 0) {
+            if (event_node_exists(sysname)) {
+                return;
+            }
+            usleep(1000);
+            continue;
+        }
+        struct pollfd pfd = { .fd = uevent_fd, .events = POLLIN };
+        if (poll(&pfd, 1, (int) left) <= 0) {
+            continue;
+        }
+        while (uevent_receive(uevent_fd, &event)) {
+            const char *action = uevent_get(&event, "ACTION"),
+                       *path = uevent_get(&event, "DEVPATH");
+            if (action != NULL && path != NULL && strcmp(action, "add") == 0 && strstr(path, devpath) != NULL) {
+                return;
+            }
+        }
+    }
+    fprintf(stderr, "Info: Virtual device [%s] was not announced within %d ms.\n", sysname, READY_TIMEOUT_MS);
+}
+
+//a key held while grabbing would only be released on the virtual device, so the grab waits for it.
+//Events queued since open() were already delivered to everyone else and are dropped.
+static bool grab_device(struct device *dev) {
+    long long deadline = now_ms() + RELEASE_TIMEOUT_MS;
+    for (;;) {
+        struct input_event evs[EVENT_BATCH];
+        while (read(dev->fd, evs, sizeof evs) > 0) {
+        }
+
+        unsigned int keys[KEY_MAX/32 + 1] = {0};
+        bool held = false;
+        if (ioctl(dev->fd, EVIOCGKEY(sizeof keys), keys) >= 0) {
+            for (size_t i = 0; i < sizeof keys / sizeof keys[0]; i++) {
+                held |= keys[i] != 0;
+            }
+        }
+        long long left = deadline - now_ms();
+        if (!held || left <= 0) {
+            break;
+        }
+        struct pollfd pfd = { .fd = dev->fd, .events = POLLIN };
+        poll(&pfd, 1, (int) left);
+    }
+    return ioctl(dev->fd, EVIOCGRAB, 1) >= 0;
+}
+
+//the compositor sets LEDs such as caps lock on the virtual device, the grabbed keyboards would never see them
+static void forward_feedback(int fdo, struct device devices[], int n_devices) {
+    struct input_event evs[EVENT_BATCH];
+    ssize_t n;
+    while ((n = read(fdo, evs, sizeof evs)) >= (ssize_t) sizeof *evs) {
+        struct out_buf feedback = { .len = 0 };
+        for (size_t k = 0; k < n / sizeof *evs; k++) {
+            if ((evs[k].type == EV_LED || evs[k].type == EV_SND) && feedback.len < OUT_MAX - 1) {
+                feedback.ev[feedback.len++] = evs[k];
+            }
+        }
+        if (feedback.len == 0) {
+            continue;
+        }
+        feedback.ev[feedback.len++] = (struct input_event) { .type = EV_SYN, .code = SYN_REPORT };
+        for (int i = 0; i < n_devices; i++) {
+            if (devices[i].fd >= 0 && devices[i].feedback && devices[i].bpf == NULL) {
+                write(devices[i].fd, feedback.ev, feedback.len * sizeof *feedback.ev);
+            }
+        }
+    }
+}
+
+static int submit_round(unsigned wait, int timeout_ms);
+static struct io_uring_sqe *get_sqe(void);
+
+static void close_device(struct device *dev) {
+    //the read holds a reference to the file, the grab would outlive close()
+    if (dev->reading) {
+        struct io_uring_sqe *sqe = get_sqe();
+        if (sqe != NULL) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = read_tag(dev);
+            sqe->user_data = TAG_NONE;
+            submit_round(0, -1);
+        }
+        dev->reading = false;
+    }
+    //a completion of the cancelled read is stale from here on
+    dev->generation++;
+    //fails if the device is gone, then there is nothing to restore
+    if (dev->repeat_off) {
+        ioctl(dev->fd, EVIOCSREP, dev->rep);
+        dev->repeat_off = false;
+    }
+    hidbpf_detach(dev->bpf);
+    dev->bpf = NULL;
+    stats_detach(dev->stats);
+    dev->stats = NULL;
+    close(dev->fd);
+    dev->fd = -1;
+}
+
+static void close_devices(struct device devices[], int n_devices) {
+    for (int i = 0; i < n_devices; i++) {
+        if (devices[i].fd >= 0) {
+            close_device(&devices[i]);
+        }
+    }
+}
+
+//the defaults, then the config file, then the command line
+static bool load_settings(struct settings *next) {
+    settings_init(next);
+    strcpy(next->layout, "dvorak");
+    next->no_toggle = 0;
+    next->no_caps_lock = 0;
+    if (configPath != NULL) {
+        struct settings file;
+        settings_init(&file);
+        if (!settings_load(&file, configPath)) {
+            return false;
+        }
+        settings_merge(next, &file);
+    }
+    settings_merge(next, &cli_settings);
+    return true;
+}
+
+static void free_profiles(struct profile list[], int n) {
+    for (int i = 0; i < n; i++) {
+        if (list[i].own_layout) {
+            free_layout(list[i].config.layout);
+        }
+    }
+}
+
+//every profile starts as a copy of base, with its own layout or with nothing remapped
+static bool compile_profiles(const struct settings *s, const struct remap_config *base, struct profile list[], int *n) {
+    *n = 0;
+    for (int i = 0; i < s->n_profiles; i++) {
+        const struct settings_profile *p = &s->profiles[i];
+        struct profile *profile = &list[*n];
+        snprintf(profile->app, sizeof profile->app, "%s", p->app);
+        profile->config = *base;
+        profile->own_layout = false;
+        if (p->off) {
+            //without modifiers the layout never applies, and every key takes the fast path
+            memset(profile->config.modifier_bits, 0, sizeof profile->config.modifier_bits);
+            memset(profile->config.trigger, 0, sizeof profile->config.trigger);
+            profile->config.rules = NULL;
+        } else if (p->layout[0] != '\0') {
+            profile->config.layout = find_layout(p->layout);
+            if (profile->config.layout == NULL) {
+                log_printf(LOG_LEVEL_ERROR, "Error: Unknown layout [%s] in the profile of [%s].\n", p->layout, p->app);
+                free_profiles(list, *n);
+                *n = 0;
+                return false;
+            }
+            profile->own_layout = true;
+        }
+        (*n)++;
+    }
+    return true;
+}
+
+//the profile of app, or config if it has none
+static const struct remap_config *find_profile(const char *app) {
+    for (int i = 0; i < n_profiles; i++) {
+        if (strcmp(profiles[i].app, app) == 0) {
+            return &profiles[i].config;
+        }
+    }
+    return &config;
+}
+
+//builds the remapping for next, it replaces config once the keyboards are idle
+static bool prepare_settings(const struct settings *next) {
+    const struct layout *layout = find_layout(next->layout);
+    if (layout == NULL) {
+        log_printf(LOG_LEVEL_ERROR, "Error: Unknown layout [%s], the configuration is not changed.\n", next->layout);
+        return false;
+    }
+    //the rules file is compiled again, it may have changed even if the path did not
+    const struct rules *rules = NULL;
+    if (next->rules[0] != '\0' && (rules = rules_load(next->rules)) == NULL) {
+        log_printf(LOG_LEVEL_ERROR, "Error: Cannot load rules [%s], the configuration is not changed.\n", next->rules);
+        free_layout(layout);
+        return false;
+    }
+    struct remap_config next_config;
+    remap_init(&next_config, layout, rules, next->no_toggle > 0, next->no_caps_lock > 0);
+    static struct profile next_profiles[SETTINGS_PROFILES];
+    int n_next_profiles;
+    if (!compile_profiles(next, &next_config, next_profiles, &n_next_profiles)) {
+        log_printf(LOG_LEVEL_ERROR, "Error: The configuration is not changed.\n");
+        rules_free(rules);
+        free_layout(layout);
+        return false;
+    }
+
+    if (has_pending && pending.layout != config.layout) {
+        free_layout(pending.layout);
+    }
+    if (has_pending) {
+        rules_free(pending.rules);
+        free_profiles(pending_profiles, n_pending_profiles);
+    }
+    pending = next_config;
+    memcpy(pending_profiles, next_profiles, n_next_profiles * sizeof *next_profiles);
+    n_pending_profiles = n_next_profiles;
+    settings = *next;
+    has_pending = true;
+    return true;
+}
+
+//a message on the control socket is "reload" or lines of settings on top of the current ones, only from root.
+//"focus APP" is accepted from anyone, the helper of the compositor runs as the user.
+static void handle_control(void) {
+    char msg[CONTROL_MAX];
+    uid_t uid;
+    while (control_receive(control_fd, msg, sizeof msg, &uid) >= 0) {
+        //a focus change is applied in apply_focus()
+        if (strncmp(msg, "focus ", 6) == 0) {
+            snprintf(focused, sizeof focused, "%.*s", (int) strcspn(msg + 6, " \t\r\n"), msg + 6);
+            focus_next = find_profile(focused);
+            continue;
+        }
+        if (uid != 0) {
+            log_printf(LOG_LEVEL_INFO, "Info: Ignoring a control message of user %d, only focus is allowed.\n",
+                       (int) uid);
+            continue;
+        }
+        struct settings next;
+        if (strncmp(msg, "reload", 6) == 0 && msg[6 + strspn(msg + 6, " \t\r\n")] == '\0') {
+            if (load_settings(&next)) {
+                prepare_settings(&next);
+            }
+            continue;
+        }
+        struct settings change;
+        settings_init(&change);
+        if (settings_parse(&change, msg)) {
+            next = settings;
+            settings_merge(&next, &change);
+            prepare_settings(&next);
+        }
+    }
+}
+
+//swaps in the pending configuration between two reads, when no modifier or remapped key is held.
+//The grab and the virtual device stay, a device that does not match anymore is released.
+static void apply_pending(int epfd, struct device devices[], int n_devices, int *n_active) {
+    for (int i = 0; i < n_devices; i++) {
+        if (devices[i].fd >= 0 && !remap_idle(&devices[i].state)) {
+            return;
+        }
+    }
+    free_profiles(profiles, n_profiles);
+    if (pending.layout != config.layout) {
+        free_layout(config.layout);
+    }
+    rules_free(config.rules);
+    config = pending;
+    memcpy(profiles, pending_profiles, n_pending_profiles * sizeof *pending_profiles);
+    n_profiles = n_pending_profiles;
+    has_pending = false;
+    //the focused app keeps its profile, compiled from the new config
+    current = find_profile(focused);
+    focus_next = NULL;
+    for (int i = 0; i < n_devices; i++) {
+        if (devices[i].fd >= 0) {
+            remap_rebase(current, &devices[i].state);
+        }
+    }
+
+    const char *match = settings_match(&settings);
+    for (int i = 0; i < n_devices; i++) {
+        struct device *dev = &devices[i];
+        if (dev->fd < 0) {
+            continue;
+        }
+        if (!match_device(dev->name, match)) {
+            log_printf(LOG_LEVEL_INFO, "Info: Releasing device [%s], it does not match [%s].\n", dev->path, match);
+            epoll_ctl(epfd, EPOLL_CTL_DEL, dev->fd, NULL);
+            close_device(dev);
+            (*n_active)--;
+        } else if (dev->bpf != NULL) {
+            //the mapping is part of the program, load it again
+            hidbpf_detach(dev->bpf);
+            dev->bpf = hidbpf_attach(dev->path, &config);
+            if (dev->bpf == NULL && !grab_device(dev)) {
+                log_printf(LOG_LEVEL_ERROR, "Cannot grab key for device [%s]: %s.\n", dev->path, strerror(errno));
+                epoll_ctl(epfd, EPOLL_CTL_DEL, dev->fd, NULL);
+                close_device(dev);
+                (*n_active)--;
+            }
+        }
+    }
+    log_printf(LOG_LEVEL_INFO, "Info: Configuration changed, layout [%s], toggle [%s], caps lock as modifier [%s], "
+               "%d rules.\n", config.layout->name, config.no_toggle ? "off" : "on",
+               config.modifier_bits[KEY_CAPSLOCK] ? "on" : "off", config.rules != NULL ? config.rules->n_rules : 0);
+}
+
+//switches to the profile of the focused app between two reads, when no modifier or remapped key is held
+static void apply_focus(struct device devices[], int n_devices) {
+    for (int i = 0; i < n_devices; i++) {
+        if (devices[i].fd >= 0 && !remap_idle(&devices[i].state)) {
+            return;
+        }
+    }
+    current = focus_next;
+    focus_next = NULL;
+    //a profile without modifiers is idle while ctrl is held, the new one has to know that it is
+    for (int i = 0; i < n_devices; i++) {
+        if (devices[i].fd >= 0) {
+            remap_rebase(current, &devices[i].state);
+        }
+    }
+    log_printf(LOG_LEVEL_DEBUG, "Info: Focus on [%s], %s.\n", focused,
+               current == &config ? "no profile" : "using its profile");
+}
+
+//the read of dev is submitted with the next round, after the writes of this one
+static void rearm(struct device *dev) {
+    if (!dev->rearm) {
+        dev->rearm = true;
+        rearm_list[n_rearm++] = dev;
+    }
+}
+
+static struct io_uring_sqe *get_sqe(void) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+    if (sqe == NULL) {
+        //the queue is full, the kernel takes what is there
+        uring_submit(&ring, 0, -1);
+        sqe = uring_get_sqe(&ring);
+    }
+    return sqe;
+}
+
+//the writes of a round are one chain, the hard link keeps their order even if one fails. The chain ends
+//before the reads, which wait for the keyboard. Returns what uring_submit() returns.
+static int submit_round(unsigned wait, int timeout_ms) {
+    struct io_uring_sqe *last = uring_last_sqe(&ring);
+    if (last != NULL && last->opcode == IORING_OP_WRITE) {
+        last->flags &= ~IOSQE_IO_HARDLINK;
+    }
+    for (; n_rearm > 0; n_rearm--) {
+        struct device *dev = rearm_list[n_rearm - 1];
+        dev->rearm = false;
+        if (dev->fd < 0 || dev->reading) {
+            continue;
+        }
+        struct io_uring_sqe *sqe = get_sqe();
+        if (sqe == NULL) {
+            dev->rearm = true;
+            break;
+        }
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = dev->fd;
+        sqe->addr = (uintptr_t) dev->buf;
+        sqe->len = readBatch * sizeof *dev->buf;
+        sqe->off = (uint64_t) -1;
+        sqe->user_data = read_tag(dev);
+        dev->reading = true;
+    }
+    return uring_submit(&ring, wait, timeout_ms);
+}
+
+static void finish_write(struct device_stats *stats, struct latency *latency, const struct input_event *evs, int res) {
+    if (res < 0) {
+        stats_add(&stats->write_errors, 1);
+    } else {
+        stats_add(&stats->events_emitted, res / sizeof *evs);
+        stats_add(&stats->bytes_written, res);
+        record_written(latency, evs, res / sizeof *evs);
+    }
+}
+
+//the events are still in stage, it is only reused once no write is in flight
+static void complete_write(const struct io_uring_cqe *cqe) {
+    const struct staged_write *write = &staged[cqe->user_data >> 3];
+    writes_in_flight--;
+    finish_write(write->stats, write->latency, &stage[write->start], cqe->res);
+}
+
+static void defer(const struct io_uring_cqe *cqe) {
+    switch (cqe->user_data & TAG_MASK) {
+        case TAG_POLL:
+            //the poll ends if any of them says so
+            if (has_poll_deferred) {
+                poll_deferred.flags &= cqe->flags;
+                poll_deferred.res = cqe->res < 0 ? cqe->res : poll_deferred.res;
+            } else {
+                poll_deferred = *cqe;
+                has_poll_deferred = true;
+            }
+            break;
+        case TAG_READ: {
+            struct device *dev = &uring_devices[cqe->user_data >> 32];
+            //the others were cancelled, or belong to a device that was in the slot before
+            if (cqe->res != -ECANCELED && dev->fd >= 0 && cqe->user_data == read_tag(dev)) {
+                dev->deferred = *cqe;
+                dev->has_deferred = true;
+                reads_deferred = true;
+            }
+            break;
+        }
+    }
+}
+
+//stage is full: waits until its writes are done, the other completions are handled later by reap()
+static void drain_writes(void) {
+    submit_round(0, -1);
+    while (writes_in_flight > 0) {
+        int ret = uring_submit(&ring, 1, -1);
+        if (ret < 0 && ret != -EINTR) {
+            return;
+        }
+        struct io_uring_cqe cqe;
+        while (uring_pop(&ring, &cqe)) {
+            if ((cqe.user_data & TAG_MASK) == TAG_WRITE) {
+                complete_write(&cqe);
+            } else {
+                defer(&cqe);
+            }
+        }
+    }
+    stage_len = 0;
+    n_staged = 0;
+}
+
+//consecutive writes of the same device become one, like a single write() of the whole batch
+static ssize_t queue_events(int fd, const struct input_event *evs, size_t n, struct device_stats *stats) {
+    if (stage_len + n > STAGE_MAX) {
+        drain_writes();
+    }
+    struct io_uring_sqe *last = uring_last_sqe(&ring), *sqe = NULL;
+    const struct staged_write *last_write = last != NULL && (last->user_data & TAG_MASK) == TAG_WRITE ?
+                                            &staged[last->user_data >> 3] : NULL;
+    if (last_write != NULL && last_write->stats == stats && last_write->latency == frame_latency &&
+        stage_len + n <= STAGE_MAX && last->addr + last->len == (uintptr_t) &stage[stage_len]) {
+        last->len += n * sizeof *evs;
+    } else {
+        if (stage_len + n > STAGE_MAX || (sqe = get_sqe()) == NULL) {
+            //the chain goes out first, a direct write must never overtake it
+            drain_writes();
+            sqe = stage_len + n <= STAGE_MAX ? get_sqe() : NULL;
+        }
+        if (sqe == NULL) {
+            //the ring is stuck, the writes queued before were waited for
+            ssize_t written = write(fd, evs, n * sizeof *evs);
+            finish_write(stats, frame_latency, evs, written < 0 ? -errno : (int) written);
+            return written;
+        }
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->flags = IOSQE_IO_HARDLINK;
+        sqe->fd = fd;
+        sqe->addr = (uintptr_t) &stage[stage_len];
+        sqe->len = n * sizeof *evs;
+        sqe->off = (uint64_t) -1;
+        staged[n_staged] = (struct staged_write) { .stats = stats, .latency = frame_latency, .start = stage_len };
+        sqe->user_data = (uint64_t) n_staged++ << 3 | TAG_WRITE;
+        writes_in_flight++;
+    }
+    memcpy(&stage[stage_len], evs, n * sizeof *evs);
+    stage_len += n;
+    return n * sizeof *evs;
+}
+
+//multishot: one submission keeps reporting that the epoll fd has events, re-armed when the kernel ends it
+static void arm_poll(int epfd) {
+    struct io_uring_sqe *sqe = get_sqe();
+    if (sqe != NULL) {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = epfd;
+        sqe->poll32_events = POLLIN;
+        sqe->len = pollMultishot ? IORING_POLL_ADD_MULTI : 0;
+        sqe->user_data = TAG_POLL;
+    }
+}
+
+//grabs the device, or remaps it in the kernel, and adds it to the event loop
+static bool start_device(int epfd, struct device *dev) {
+    if (hidBpf && (dev->bpf = hidbpf_attach(dev->path, &config)) == NULL) {
+        log_printf(LOG_LEVEL_INFO, "Info: Remapping device [%s] in userspace, HID-BPF is not available: %s.\n",
+                   dev->path, strerror(errno));
+    }
+    if (dev->bpf == NULL && !grab_device(dev)) {
+        log_printf(LOG_LEVEL_ERROR, "Cannot grab key for device [%s]: %s.\n", dev->path, strerror(errno));
+        close_device(dev);
+        return false;
+    }
+    //the virtual device repeats the keys, the key it repeats is already remapped. A period of 0 stops
+    //the kernel timer of the source, its delay is kept for when repeat is turned on again in close_device().
+    if (repeatVirtual && dev->bpf == NULL && dev->has_rep) {
+        unsigned int off[2] = { dev->rep[0], 0 };
+        dev->repeat_off = ioctl(dev->fd, EVIOCSREP, off) >= 0;
+        if (!dev->repeat_off) {
+            log_printf(LOG_LEVEL_INFO, "Info: Cannot turn off autorepeat of device [%s], keys may repeat twice: %s.\n",
+                       dev->path, strerror(errno));
+        }
+    }
+    //a device remapped in the kernel is still watched to notice when it is gone
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = dev };
+    if (ring.fd >= 0) {
+        if (dev->buf == NULL && (dev->buf = malloc(EVENT_BATCH_MAX * sizeof *dev->buf)) == NULL) {
+            log_printf(LOG_LEVEL_ERROR, "Cannot watch device [%s]: %s.\n", dev->path, strerror(errno));
+            close_device(dev);
+            return false;
+        }
+        rearm(dev);
+    } else if (epoll_ctl(epfd, EPOLL_CTL_ADD, dev->fd, &event) < 0) {
+        log_printf(LOG_LEVEL_ERROR, "Cannot watch device [%s]: %s.\n", dev->path, strerror(errno));
+        close_device(dev);
+        return false;
+    }
+    dev->stats = stats_attach(dev->path, dev->name);
+    log_printf(LOG_LEVEL_INFO, "Staring event loop with keyboard: [%s] for device [%s]%s.\n", dev->name, dev->path,
+               dev->bpf != NULL ? " (HID-BPF)" : "");
+    return true;
+}
+
+//a keyboard that udev announced in shared mode joins the virtual device, which is never recreated. A device
+//that can send events the virtual device cannot is left alone, it was not there when the union was built.
+static void hotplug(int epfd, struct device devices[], int *n_devices, int *n_active, const struct caps *caps) {
+    static struct uevent event;
+    while (uevent_receive(hotplug_fd, &event)) {
+        const char *action = uevent_get(&event, "ACTION"),
+                   *subsystem = uevent_get(&event, "SUBSYSTEM"),
+                   *devname = uevent_get(&event, "DEVNAME"),
+                   *keyboard = uevent_get(&event, "ID_INPUT_KEYBOARD");
+        if (action == NULL || subsystem == NULL || devname == NULL || keyboard == NULL ||
+            strcmp(action, "add") != 0 || strcmp(subsystem, "input") != 0 || strcmp(keyboard, "1") != 0 ||
+            strncmp(devname, "/dev/input/event", 16) != 0) {
             continue;
         }
 
-        //fprintf(stderr, "Setting capability %d for event type %lu\n", i, event_type);
-        switch(event_type) {
-            case UI_SET_EVBIT:
-                if (ioctl(fdo, UI_SET_EVBIT, i) < 0) {
-                    fprintf(stderr, "Cannot set EV bit %d: %s\n", i, strerror(errno));
-                    return false;
-                }
+        struct device *dev = NULL;
+        bool known = false;
+        for (int i = 0; i < *n_devices; i++) {
+            //a slot that waits for its device to come back is not free
+            if (devices[i].fd < 0 && devices[i].reattach_deadline == 0) {
+                dev = dev != NULL ? dev : &devices[i];
+            } else if (strcmp(devices[i].path, devname) == 0) {
+                known = true;
+            }
+        }
+        if (known) {
+            continue;
+        }
+        if (dev == NULL) {
+            if (*n_devices == MAX_DEVICES) {
+                log_printf(LOG_LEVEL_INFO, "Info: Ignoring device [%s], at most %d are supported.\n", devname, MAX_DEVICES);
+                continue;
+            }
+            dev = &devices[(*n_devices)++];
+            dev->fd = -1;
+        }
+
+        struct caps dev_caps = {0};
+        if (open_device(dev, devname, settings_match(&settings), &dev_caps) != DEVICE_OK) {
+            continue;
+        }
+        if (!caps_subset(&dev_caps, caps)) {
+            log_printf(LOG_LEVEL_INFO, "Info: Device [%s] sends events the shared virtual device does not have, "
+                       "restart to include it.\n", dev->path);
+            close_device(dev);
+            continue;
+        }
+        if (start_device(epfd, dev)) {
+            (*n_active)++;
+        }
+    }
+}
+
+//the directory of path, where the device node or link shows up again
+static void watch_directory(const char *path) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof dir, "%.*s", (int) (strrchr(path, '/') != NULL ? strrchr(path, '/') - path : 0), path);
+    if (dir[0] != '\0') {
+        //fails while the directory does not exist, /dev/input is watched as well for when it is created
+        inotify_add_watch(inotify_fd, dir, IN_CREATE | IN_MOVED_TO | IN_ATTRIB);
+    }
+}
+
+//the device is gone: the keys it held are released on the virtual device, and with --reattach its path
+//is watched. The slot keeps the path, open_device() clears it once the device is back.
+static void detach_device(int fdo, struct device *dev) {
+    size_t released = 0;
+    if (dev->bpf == NULL) {
+        unsigned long keys[KEY_CNT / (8 * sizeof(long)) + 1] = {0};
+        struct timespec now;
+        clock_gettime(eventClock, &now);
+        struct timeval time = { .tv_sec = now.tv_sec, .tv_usec = now.tv_nsec / 1000 };
+        released = sync_keys(fdo, dev, keys, time);
+    }
+    close_device(dev);
+    if (reattachMs <= 0 || inotify_fd < 0) {
+        log_printf(LOG_LEVEL_INFO, "Info: Device [%s] is gone.\n", dev->path);
+        return;
+    }
+    dev->reattach_deadline = now_ms() + reattachMs;
+    watch_directory(dev->path);
+    log_printf(LOG_LEVEL_INFO, "Info: Device [%s] is gone, %zu keys released, waiting for it to come back.\n",
+               dev->path, released);
+}
+
+//something changed in a watched directory, every device that is waiting tries its path again
+static void reattach(int epfd, struct device devices[], int n_devices, int *n_active, const struct caps *caps) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (read(inotify_fd, buf, sizeof buf) > 0) {
+    }
+    for (int i = 0; i < n_devices; i++) {
+        struct device *dev = &devices[i];
+        if (dev->reattach_deadline == 0) {
+            continue;
+        }
+        watch_directory(dev->path);
+        char path[PATH_MAX];
+        snprintf(path, sizeof path, "%s", dev->path);
+        struct caps dev_caps = {0};
+        //the slot is only changed if it succeeds, until then the node may not be ready
+        if (access(path, R_OK) != 0 || open_device(dev, path, settings_match(&settings), &dev_caps) != DEVICE_OK) {
+            continue;
+        }
+        if (!caps_subset(&dev_caps, caps)) {
+            log_printf(LOG_LEVEL_INFO, "Info: Device [%s] came back with events the virtual device does not have.\n",
+                       dev->path);
+            close_device(dev);
+            continue;
+        }
+        if (start_device(epfd, dev)) {
+            log_printf(LOG_LEVEL_INFO, "Info: Device [%s] is back.\n", dev->path);
+            (*n_active)++;
+        }
+    }
+}
+
+//gives up on devices that did not come back in time, returns the ms until the next deadline, -1 if none waits
+static int expire_devices(struct device devices[], int n_devices) {
+    long long now = now_ms(), next = -1;
+    for (int i = 0; i < n_devices; i++) {
+        struct device *dev = &devices[i];
+        if (dev->reattach_deadline == 0) {
+            continue;
+        } else if (dev->reattach_deadline <= now) {
+            log_printf(LOG_LEVEL_INFO, "Info: Device [%s] did not come back.\n", dev->path);
+            dev->reattach_deadline = 0;
+        } else if (next < 0 || dev->reattach_deadline - now < next) {
+            next = dev->reattach_deadline - now;
+        }
+    }
+    return (int) next;
+}
+
+//the writer thread released every key after frames were dropped, the keys that are held are pressed again
+static void resync_output(int fdo, struct device devices[], int n_devices) {
+    unsigned long none[KEY_CNT / (8 * sizeof(long)) + 1] = {0};
+    struct timespec now;
+    clock_gettime(eventClock, &now);
+    struct timeval time = { .tv_sec = now.tv_sec, .tv_usec = now.tv_nsec / 1000 };
+    for (int i = 0; i < n_devices; i++) {
+        struct device *dev = &devices[i];
+        if (dev->fd < 0 || dev->bpf != NULL) {
+            continue;
+        }
+        //not resync_device(), the keyboard did not drop anything
+        unsigned long keys[KEY_CNT / (8 * sizeof(long)) + 1] = {0};
+        if (ioctl(dev->fd, EVIOCGKEY(sizeof keys), keys) < 0) {
+            memset(keys, 0, sizeof keys);
+        }
+        sync_keys(fdo, dev, none, time);
+        sync_keys(fdo, dev, keys, time);
+    }
+    log_printf(LOG_LEVEL_INFO, "Info: The virtual device could not keep up, all keys were released.\n");
+}
+
+//the probe only carries a scan code, so it can go out between any two frames. Returns the ms until the next one.
+static int send_probe(int fdo) {
+    if (probeMs <= 0) {
+        return -1;
+    }
+    long long now = now_ms();
+    if (now >= probe_next) {
+        struct input_event evs[2] = {
+            { .type = EV_MSC, .code = MSC_SCAN, .value = (int) (PROBE_TAG | (probe_count++ & PROBE_SEQ_MASK)) },
+            { .type = EV_SYN, .code = SYN_REPORT },
+        };
+        write_events(fdo, evs, 2, &probe_stats);
+        probe_next = now + probeMs;
+    }
+    return (int) (probe_next - now);
+}
+
+static int next_timeout(int a, int b) {
+    return a < 0 || (b >= 0 && b < a) ? b : a;
+}
+
+//other keys never wait for the timer, it only decides a tap-hold key that is held without another key
+static void arm_timer(struct device devices[], int n_devices) {
+    long long deadline = 0;
+    for (int i = 0; timer_fd >= 0 && i < n_devices; i++) {
+        if (devices[i].state.pending != 0) {
+            long long next = remap_hold_deadline(current, &devices[i].state);
+            if (deadline == 0 || next < deadline) {
+                deadline = next;
+            }
+        }
+    }
+    if (deadline == timer_deadline) {
+        return;
+    }
+    //all zero disarms it
+    struct itimerspec spec = { .it_value = { .tv_sec = deadline / 1000000, .tv_nsec = deadline % 1000000 * 1000 } };
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) == 0) {
+        timer_deadline = deadline;
+    }
+}
+
+//the timer fired, the tap-hold keys that were held long enough are held from now on
+static void expire_holds(int fdo, struct device devices[], int n_devices) {
+    uint64_t expirations;
+    if (read(timer_fd, &expirations, sizeof expirations) < 0 && errno != EAGAIN) {
+        return;
+    }
+    timer_deadline = 0;
+    struct timespec ts;
+    clock_gettime(eventClock, &ts);
+    long long now = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+    for (int i = 0; i < n_devices; i++) {
+        if (remap_timeout(current, &devices[i].state, now, &out)) {
+            flush(fdo, &out, devices[i].stats);
+        }
+    }
+}
+
+static void dispatch(int epfd, int fdo, struct epoll_event events[], int n, struct device devices[], int *n_devices,
+                     int *n_active, const struct caps *caps) {
+    for (int i = 0; i < n; i++) {
+        if (events[i].data.ptr == &control_fd) {
+            handle_control();
+            continue;
+        }
+        if (events[i].data.ptr == &hotplug_fd) {
+            hotplug(epfd, devices, n_devices, n_active, caps);
+            continue;
+        }
+        if (events[i].data.ptr == &inotify_fd) {
+            reattach(epfd, devices, *n_devices, n_active, caps);
+            continue;
+        }
+        if (events[i].data.ptr == &timer_fd) {
+            expire_holds(fdo, devices, *n_devices);
+            continue;
+        }
+        struct device *dev = events[i].data.ptr;
+        if (dev == NULL) {
+            forward_feedback(fdo, devices, *n_devices);
+            continue;
+        }
+        if (!read_device(fdo, dev)) {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, dev->fd, NULL);
+            detach_device(fdo, dev);
+            (*n_active)--;
+        }
+    }
+}
+
+//--io-uring: one completion, a read that is done is submitted again with the next round
+static void complete(const struct io_uring_cqe *cqe, int epfd, int fdo, struct device devices[], int *n_devices,
+                     int *n_active, const struct caps *caps) {
+    switch (cqe->user_data & TAG_MASK) {
+        case TAG_WRITE:
+            complete_write(cqe);
+            break;
+        case TAG_POLL: {
+            if (cqe->res == -EINVAL && pollMultishot) {
+                //before 5.13
+                pollMultishot = false;
+                arm_poll(epfd);
                 break;
-            case UI_SET_KEYBIT:
-                if (ioctl(fdo, UI_SET_KEYBIT, i) < 0) {
-                    fprintf(stderr, "Cannot set KEY bit %d: %s\n", i, strerror(errno));
-                    return false;
-                }
+            }
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                arm_poll(epfd);
+            }
+            //the poll fires again only for new events, so everything that is ready is handled now
+            struct epoll_event events[MAX_DEVICES];
+            int n;
+            do {
+                n = epoll_wait(epfd, events, MAX_DEVICES, 0);
+                dispatch(epfd, fdo, events, n, devices, n_devices, n_active, caps);
+            } while (n == MAX_DEVICES);
+            break;
+        }
+        case TAG_READ: {
+            struct device *dev = &devices[cqe->user_data >> 32];
+            //cancelled by close_device(), or done for a device that was in the slot before
+            if (cqe->res == -ECANCELED || dev->fd < 0 || cqe->user_data != read_tag(dev)) {
                 break;
-            case UI_SET_RELBIT:
-                if (ioctl(fdo, UI_SET_RELBIT, i) < 0) {
-                    fprintf(stderr, "Cannot set REL bit %d: %s\n", i, strerror(errno));
-                    return false;
-                }
+            }
+            dev->reading = false;
+            if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+                rearm(dev);
                 break;
-            case UI_SET_ABSBIT:
-                if (!abs_init_once) {
-                    abs_setup.code = i;
-                    if (ioctl(fdi, EVIOCGABS(i), &abs_setup.absinfo) < 0) {
-                        fprintf(stderr, "Failed to get ABS info for axis %d: %s\n", i, strerror(errno));
-                        continue;
-                    }
-                    if (ioctl(fdo, UI_ABS_SETUP, &abs_setup) < 0) {
-                        fprintf(stderr, "Failed to setup ABS axis %d: %s\n", i, strerror(errno));
-                        continue;
-                    }
-                    abs_init_once = true;
-                }
+            }
+            if (cqe->res < 0) {
+                stats_add(&dev->stats->read_errors, 1);
+            }
+            if (cqe->res >= 0 && handle_events(fdo, dev, dev->buf, cqe->res)) {
+                rearm(dev);
+            } else {
+                detach_device(fdo, dev);
+                (*n_active)--;
+            }
+            break;
+        }
+    }
+}
 
-                if (ioctl(fdo, UI_SET_ABSBIT, i) < 0) {
-                    fprintf(stderr, "Cannot set ABS bit %d: %s\n", i, strerror(errno));
-                    return false;
+//all completions, the ones drain_writes() put aside first. Handling one can put aside more.
+static void reap(int epfd, int fdo, struct device devices[], int *n_devices, int *n_active, const struct caps *caps) {
+    struct io_uring_cqe cqe;
+    for (;;) {
+        if (has_poll_deferred) {
+            cqe = poll_deferred;
+            has_poll_deferred = false;
+            complete(&cqe, epfd, fdo, devices, n_devices, n_active, caps);
+        } else if (reads_deferred) {
+            reads_deferred = false;
+            for (int i = 0; i < *n_devices; i++) {
+                if (devices[i].has_deferred) {
+                    devices[i].has_deferred = false;
+                    cqe = devices[i].deferred;
+                    complete(&cqe, epfd, fdo, devices, n_devices, n_active, caps);
                 }
-                break;
-            case UI_SET_MSCBIT:
-                if (ioctl(fdo, UI_SET_MSCBIT, i) < 0) {
-                    fprintf(stderr, "Cannot set MSC bit %d: %s\n", i, strerror(errno));
-                    return false;
-                }
-                break;
+            }
+        } else if (uring_pop(&ring, &cqe)) {
+            complete(&cqe, epfd, fdo, devices, n_devices, n_active, caps);
+        } else {
+            break;
         }
     }
-    return true;
+    if (writes_in_flight == 0) {
+        stage_len = 0;
+        n_staged = 0;
+    }
 }
 
 static void usage(const char *path) {
@@ -257,38 +1469,212 @@ static void usage(const char *path) {
 
     fprintf(stderr, "usage: %s [OPTION]\n", basename);
     fprintf(stderr, "  -d /dev/input/by-id/…\t"
-                    "Specifies which device should be captured.\n");
+                    "Specifies which device should be captured.\n"
+                    "\t\t\tCan be given multiple times, all devices share one virtual keyboard.\n");
+    fprintf(stderr, "  -a\t\t\t"
+                    "Capture all keyboards found in /dev/input.\n");
     fprintf(stderr, "  -m STRING\t\t"
                     "Match only the STRING with the USB device name. \n"
                     "\t\t\tSTRING can contain multiple words, separated by space.\n");
     fprintf(stderr, "  -t\t\t\t"
                     "Disable layout toggle feature (press Left-Alt 3 times to switch layout).\n");
     fprintf(stderr, "  -c\t\t\t"
-                    "Disable caps lock as a modifier.\n\n");
+                    "Disable caps lock as a modifier.\n");
+    fprintf(stderr, "  -l LAYOUT\t\t"
+                    "Layout that is active on the keyboard: dvorak (default), colemak, workman,\n"
+                    "\t\t\tthe name of a file in " LAYOUT_DIR "/NAME.map, or a path to a layout file.\n");
+    fprintf(stderr, "  -L\t\t\t"
+                    "Measure the latency from input to output, send SIGUSR1 to print p50/p99/max.\n");
+    fprintf(stderr, "  -R, --realtime\t\t"
+                    "Lock all memory and pre-fault the stack before the event loop starts.\n");
+    fprintf(stderr, "  -P, --rt-priority N\t"
+                    "Run the event loop as SCHED_FIFO with priority N (1-99).\n");
+    fprintf(stderr, "  -C, --cpu N\t\t"
+                    "Pin the process to CPU N.\n");
+    fprintf(stderr, "  -B, --hid-bpf\t\t"
+                    "Remap boot protocol keyboards in the kernel with HID-BPF (make HID_BPF=1),\n"
+                    "\t\t\tother devices are remapped in userspace.\n");
+    fprintf(stderr, "  -f, --config FILE\t"
+                    "Read layout, match, toggle, and caps-lock-modifier from FILE, again on SIGHUP.\n");
+    fprintf(stderr, "  -s, --control PATH\t"
+                    "Accept \"reload\" or settings on a unix datagram socket at PATH.\n");
+    fprintf(stderr, "  -S, --shared\t\t"
+                    "Capture all keyboards, also those plugged in later, with one virtual device\n"
+                    "\t\t\tthat has the keys of any keyboard. Implies -a.\n");
+    fprintf(stderr, "  -b, --read-batch N\t"
+                    "Read up to N events at once (default %d, at most %d).\n", EVENT_BATCH, EVENT_BATCH_MAX);
+    fprintf(stderr, "  -k, --clock CLOCK\t"
+                    "Timestamp events with monotonic, realtime, or boottime. -L implies monotonic.\n");
+    fprintf(stderr, "  -v, --verbose\t\t"
+                    "Also log the devices that are skipped.\n");
+    fprintf(stderr, "  -y, --rules FILE\t"
+                    "Shortcuts, tap-hold keys, and layers from FILE, see rules.c.\n");
+    fprintf(stderr, "  -w, --reattach SECONDS\n"
+                    "\t\t\tKeep the virtual device for SECONDS when a keyboard is gone, and grab it\n"
+                    "\t\t\tagain when its path comes back, e.g. a link in /dev/input/by-id.\n");
+    fprintf(stderr, "  -r, --repeat\t\t"
+                    "Repeat held keys on the virtual device instead of reading the repeats of the keyboards.\n");
+    fprintf(stderr, "  -i, --io-uring[=sqpoll]\n"
+                    "\t\t\tKeep the reads of all keyboards submitted to an io_uring and write each round\n"
+                    "\t\t\twith one system call, with sqpoll a kernel thread submits. Falls back to epoll.\n");
+    fprintf(stderr, "  -e, --seat SEAT\t"
+                    "Only grab keyboards on SEAT, e.g. seat1, one instance per seat with -S.\n");
+    fprintf(stderr, "  -o, --writer-thread\t"
+                    "Write to the virtual device from a second thread, keyboards are read while it waits.\n");
+    fprintf(stderr, "  -q, --probe MS\t\t"
+                    "Send a tagged scan code every MS ms, dvorak-probe measures how long it takes to arrive.\n");
+    fprintf(stderr, "  -x, --stats PATH\t"
+                    "Keep per-device counters in a shared file at PATH, e.g. /run/dvorak/stats.\n");
+    fprintf(stderr, "  -p, --print-stats PATH...\n"
+                    "\t\t\tPrint the counters of running instances in the Prometheus text format.\n\n");
     fprintf(stderr, "example: %s -u -d /dev/input/by-id/usb-Logitech_USB_Receiver-if02-event-kbd -m \"k750 k350\"\n", basename);
 }
 
 int main(int argc, char *argv[]) {
     signal(SIGTERM, sig_handler);
+    signal(SIGUSR1, report_handler);
+    signal(SIGHUP, reload_handler);
 
-    int opt;
-    char *device = NULL,
-         *match = NULL;
-    bool noToggle = false,
-         noCapsLockAsModifier = false;
-    while ((opt = getopt(argc, argv, "d:m:tc")) != -1) {
+    int opt, log_level = LOG_LEVEL_INFO;
+    const char *paths[MAX_DEVICES];
+    int n_paths = 0;
+    const char *control_path = NULL,
+               *stats_path = NULL;
+    bool discover = false,
+         print_stats = false;
+    settings_init(&cli_settings);
+    struct realtime rt = { .lock_memory = false, .priority = 0, .cpu = -1 };
+    static const struct option long_options[] = {
+        {"realtime", no_argument, NULL, 'R'},
+        {"rt-priority", required_argument, NULL, 'P'},
+        {"cpu", required_argument, NULL, 'C'},
+        {"hid-bpf", no_argument, NULL, 'B'},
+        {"config", required_argument, NULL, 'f'},
+        {"control", required_argument, NULL, 's'},
+        {"shared", no_argument, NULL, 'S'},
+        {"read-batch", required_argument, NULL, 'b'},
+        {"clock", required_argument, NULL, 'k'},
+        {"verbose", no_argument, NULL, 'v'},
+        {"stats", required_argument, NULL, 'x'},
+        {"print-stats", no_argument, NULL, 'p'},
+        {"repeat", no_argument, NULL, 'r'},
+        {"rules", required_argument, NULL, 'y'},
+        {"reattach", required_argument, NULL, 'w'},
+        {"seat", required_argument, NULL, 'e'},
+        {"probe", required_argument, NULL, 'q'},
+        {"writer-thread", no_argument, NULL, 'o'},
+        {"io-uring", optional_argument, NULL, 'i'},
+        {NULL, 0, NULL, 0}
+    };
+    while ((opt = getopt_long(argc, argv, "d:am:tcl:LRP:C:Bf:s:Sb:k:vx:pry:w:e:i::q:o", long_options, NULL)) != -1) {
         switch (opt) {
             case 'd':
-                device = optarg;
+                if (n_paths == MAX_DEVICES) {
+                    fprintf(stderr, "Error: Too many devices, at most %d are supported.\n", MAX_DEVICES);
+                    return EXIT_FAILURE;
+                }
+                paths[n_paths++] = optarg;
+                break;
+            case 'a':
+                discover = true;
                 break;
             case 'm':
-                match = optarg;
+                snprintf(cli_settings.match, sizeof cli_settings.match, "%s", optarg);
+                cli_settings.has_match = true;
                 break;
             case 't':
-                noToggle = true;
+                cli_settings.no_toggle = 1;
                 break;
             case 'c':
-                noCapsLockAsModifier = true;
+                cli_settings.no_caps_lock = 1;
+                break;
+            case 'L':
+                measureLatency = true;
+                break;
+            case 'l':
+                snprintf(cli_settings.layout, sizeof cli_settings.layout, "%s", optarg);
+                break;
+            case 'R':
+                rt.lock_memory = true;
+                break;
+            case 'P':
+                rt.priority = atoi(optarg);
+                break;
+            case 'C':
+                rt.cpu = atoi(optarg);
+                break;
+            case 'B':
+                hidBpf = true;
+                break;
+            case 'f':
+                configPath = optarg;
+                break;
+            case 's':
+                control_path = optarg;
+                break;
+            case 'S':
+                shared = true;
+                discover = true;
+                break;
+            case 'b':
+                readBatch = atoi(optarg);
+                if (readBatch < 1 || readBatch > EVENT_BATCH_MAX) {
+                    fprintf(stderr, "Error: The read batch must be between 1 and %d events.\n", EVENT_BATCH_MAX);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'v':
+                log_level = LOG_LEVEL_DEBUG;
+                break;
+            case 'x':
+                stats_path = optarg;
+                break;
+            case 'p':
+                print_stats = true;
+                break;
+            case 'r':
+                repeatVirtual = true;
+                break;
+            case 'w':
+                reattachMs = atoi(optarg) * 1000;
+                break;
+            case 'e':
+                seatName = optarg;
+                break;
+            case 'o':
+                writerThread = true;
+                break;
+            case 'q':
+                probeMs = atoi(optarg);
+                if (probeMs < 1 || probeMs > 60000) {
+                    fprintf(stderr, "Error: The probe interval must be between 1 and 60000 ms.\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'i':
+                ioUring = true;
+                if (optarg != NULL && strcmp(optarg, "sqpoll") != 0) {
+                    fprintf(stderr, "Error: Unknown io_uring mode [%s], use --io-uring or --io-uring=sqpoll.\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                ioUringPoll = optarg != NULL;
+                break;
+            case 'y':
+                snprintf(cli_settings.rules, sizeof cli_settings.rules, "%s", optarg);
+                cli_settings.has_rules = true;
+                break;
+            case 'k':
+                clockSet = true;
+                if (strcmp(optarg, "monotonic") == 0) {
+                    eventClock = CLOCK_MONOTONIC;
+                } else if (strcmp(optarg, "realtime") == 0) {
+                    eventClock = CLOCK_REALTIME;
+                } else if (strcmp(optarg, "boottime") == 0) {
+                    eventClock = CLOCK_BOOTTIME;
+                } else {
+                    fprintf(stderr, "Error: Unknown clock [%s], use monotonic, realtime, or boottime.\n", optarg);
+                    return EXIT_FAILURE;
+                }
                 break;
             default:
                 usage(argv[0]);
@@ -296,305 +1682,309 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    if (device == NULL) {
-        usage(argv[0]);
-        fprintf(stderr, "Error: Input device not specified.\n");
-        fprintf(stderr, "Hint: Provide a valid input device, typically found under /dev/input/by-id/...\n");
-        return EXIT_FAILURE;
+    log_init(log_level);
+    //the files of running instances are the remaining arguments, nothing is captured
+    if (print_stats) {
+        return stats_print(argc - optind, &argv[optind]);
     }
 
-    //Start the fdi setup
-    fdi = open(device, O_RDONLY);
-    if (fdi < 0) {
-        fprintf(stderr, "Error: Failed to open device [%s]: %s.\n", device, strerror(errno));
-        fprintf(stderr, "Hint: Check if the device path is correct and you have the necessary permissions.\n");
-        return EXIT_FAILURE;
+    //the latency is measured against a clock that does not jump
+    if (measureLatency && !clockSet) {
+        clockSet = true;
+        eventClock = CLOCK_MONOTONIC;
     }
 
-    char keyboard_name[UINPUT_MAX_NAME_SIZE] = "Unknown";
-    int ret_val = ioctl(fdi, EVIOCGNAME(sizeof(keyboard_name) - 1), keyboard_name);
-    if (ret_val < 0) {
-        fprintf(stderr, "Error: Unable to retrieve device name for [%s]: %s.\n", device, strerror(errno));
-        fprintf(stderr, "Hint: Verify if the device is functional and properly configured.\n");
-        close(fdi);
+    if (!load_settings(&settings)) {
         return EXIT_FAILURE;
     }
-
-    struct uinput_setup usetup =
-            { .id =
-                { .bustype = BUS_USB, .vendor = 0x1111, .product = 0x2222 },
-              .name = "Virtual Dvorak Keyboard" };
-    if (strcmp(keyboard_name, usetup.name) == 0) {
-        fprintf(stdout, "Info: Skipping mapping for the device we just created: %s.\n", keyboard_name);
-        close(fdi);
-        return EXIT_SUCCESS;
+    const struct layout *layout = find_layout(settings.layout);
+    if (layout == NULL) {
+        fprintf(stderr, "Error: Unknown layout [%s].\n", settings.layout);
+        fprintf(stderr, "Hint: Use dvorak, colemak, workman, or a layout file in %s.\n", LAYOUT_DIR);
+        return EXIT_FAILURE;
     }
-
-    ret_val = -1;
-    if (match != NULL) {
-        char *token = strtok(match, " ");
-        while (token != NULL) {
-            if (strcasestr(keyboard_name, token) != NULL) {
-                printf("Info: Found matching input: [%s] for device [%s].\n", keyboard_name, device);
-                ret_val = 0;
-                break;
-            }
-            token = strtok(NULL, " ");
-        }
-        if (ret_val < 0) {
-            fprintf(stderr, "Error: Device [%s] does not match any of the specified keywords: [%s].\n", keyboard_name, match);
-            close(fdi);
-            return EXIT_FAILURE;
-        }
+    const struct rules *rules = NULL;
+    if (settings.rules[0] != '\0' && (rules = rules_load(settings.rules)) == NULL) {
+        return EXIT_FAILURE;
     }
-
-    // Read capabilities
-    unsigned int
-        array_bit_ev[EV_MAX/32 + 1]= {0},
-        array_bit_key[KEY_MAX/32 + 1]= {0},
-        array_bit_rel[REL_MAX/32 + 1]= {0},
-        array_bit_abs[ABS_MAX/32 + 1]= {0},
-        array_bit_msc[MSC_MAX/32 + 1]= {0};
-
-    ret_val = ioctl(fdi, EVIOCGBIT(0, sizeof(array_bit_ev)), &array_bit_ev);
-    if (ret_val < 0) {
-        fprintf(stderr, "Error: Failed to retrieve event capabilities for device [%s]: %s.\n", device, strerror(errno));
-        close(fdi);
+    remap_init(&config, layout, rules, settings.no_toggle > 0, settings.no_caps_lock > 0);
+    if (!compile_profiles(&settings, &config, profiles, &n_profiles)) {
         return EXIT_FAILURE;
     }
+    const char *match = settings_match(&settings);
 
-    if (has_event_type(array_bit_ev, EV_KEY)) {
-        ret_val = ioctl(fdi, EVIOCGBIT(EV_KEY, sizeof(array_bit_key)), &array_bit_key);
-        if (ret_val < 0) {
-            fprintf(stderr, "Error: Failed to retrieve EV_KEY capabilities for device [%s]: %s.\n", device, strerror(errno));
-            close(fdi);
-            return EXIT_FAILURE;
-        }
+    if (discover) {
+        n_paths += discover_devices(paths + n_paths, MAX_DEVICES - n_paths);
     }
 
-    if (has_event_type(array_bit_ev, EV_REL)) {
-        ret_val = ioctl(fdi, EVIOCGBIT(EV_REL, sizeof(array_bit_rel)), &array_bit_rel);
-        if (ret_val < 0) {
-            fprintf(stderr, "Error: Failed to retrieve EV_REL capabilities for device [%s]: %s.\n", device, strerror(errno));
-            close(fdi);
-            return EXIT_FAILURE;
-        }
+    if (n_paths == 0 && !shared) {
+        usage(argv[0]);
+        fprintf(stderr, "Error: Input device not specified.\n");
+        fprintf(stderr, "Hint: Provide a valid input device, typically found under /dev/input/by-id/...\n");
+        return EXIT_FAILURE;
     }
 
-    if (has_event_type(array_bit_ev, EV_ABS)) {
-        ret_val = ioctl(fdi, EVIOCGBIT(EV_ABS, sizeof(array_bit_abs)), &array_bit_abs);
-        if (ret_val < 0) {
-            fprintf(stderr, "Error: Failed to retrieve EV_ABS capabilities for device [%s]: %s.\n", device, strerror(errno));
-            close(fdi);
-            return EXIT_FAILURE;
-        }
+    static struct device devices[MAX_DEVICES];
+    static struct caps caps;
+    int n_devices = 0;
+    bool failed = false;
+    if (shared) {
+        caps_keyboard(&caps);
     }
-
-    if (has_event_type(array_bit_ev, EV_MSC)) {
-        ret_val = ioctl(fdi, EVIOCGBIT(EV_MSC, sizeof(array_bit_msc)), &array_bit_msc);
-        if (ret_val < 0) {
-            fprintf(stderr, "Error: Failed to retrieve EV_MSC capabilities for device [%s]: %s.\n", device, strerror(errno));
-            close(fdi);
-            return EXIT_FAILURE;
+    for (int i = 0; i < n_paths; i++) {
+        int ret_val = open_device(&devices[n_devices], paths[i], match, &caps);
+        if (ret_val == DEVICE_OK) {
+            n_devices++;
+        } else if (ret_val == DEVICE_ERROR) {
+            failed = true;
         }
     }
 
-    //Check we are a keyboard
-    if (!(array_bit_key[KEY_X / 32] & (1 << (KEY_X % 32))) ||
-        !(array_bit_key[KEY_C / 32] & (1 << (KEY_C % 32))) ||
-        !(array_bit_key[KEY_V / 32] & (1 << (KEY_V % 32)))) {
-        fprintf(stdout, "Info: Device [%s] is not recognized as a keyboard (missing essential keys).\n", device);
-        close(fdi);
-        return EXIT_SUCCESS;
+    //nothing to capture, this is only an error if one of the devices could not be used
+    if (n_devices == 0 && !shared) {
+        return failed ? EXIT_FAILURE : EXIT_SUCCESS;
     }
 
     // Start the uinput setup
-    int fdo = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+    //LED changes of the virtual device are read back from it
+    int fdo = open("/dev/uinput", O_RDWR | O_NONBLOCK);
     if (fdo < 0) {
-        fprintf(stderr, "Error: Failed to open /dev/uinput for device [%s]: %s.\n", device, strerror(errno));
-        close(fdi);
+        fprintf(stderr, "Error: Failed to open /dev/uinput: %s.\n", strerror(errno));
+        close_devices(devices, n_devices);
         return EXIT_FAILURE;
     }
 
     // Configure the virtual device
     if (ioctl(fdo, UI_DEV_SETUP, &usetup) < 0) {
-        fprintf(stderr, "Error: Failed to configure the virtual device for [%s]: %s.\n", device, strerror(errno));
+        fprintf(stderr, "Error: Failed to configure the virtual device: %s.\n", strerror(errno));
         close(fdo);
-        close(fdi);
+        close_devices(devices, n_devices);
         return EXIT_FAILURE;
     }
 
-    if(!setup_event_type(fdo, UI_SET_EVBIT, EV_SW, array_bit_ev)) {
-        fprintf(stderr, "Cannot setup_event_type for UI_SET_EVBIT/device [%s]: %s.\n", device, strerror(errno));
-        close(fdo);
-        close(fdi);
-        return EXIT_FAILURE;
+    //logind puts the virtual device on this seat, see 80-dvorak.rules
+    const char *seat = seatName != NULL ? seatName : n_devices > 0 ? devices[0].seat : "seat0";
+    if (strcmp(seat, "seat0") != 0 && ioctl(fdo, UI_SET_PHYS, seat) < 0) {
+        fprintf(stderr, "Info: Cannot put the virtual device on seat [%s]: %s.\n", seat, strerror(errno));
     }
 
-    if(!setup_event_type(fdo, UI_SET_KEYBIT, KEY_MAX, array_bit_key)) {
-        fprintf(stderr, "Cannot setup_event_type for EV_KEY/device [%s]: %s.\n", device, strerror(errno));
+    if (!caps_setup(fdo, &caps, repeatVirtual)) {
+        fprintf(stderr, "Cannot setup the capabilities of the virtual device: %s.\n", strerror(errno));
         close(fdo);
-        close(fdi);
+        close_devices(devices, n_devices);
         return EXIT_FAILURE;
     }
 
-    if(!setup_event_type(fdo, UI_SET_RELBIT, REL_MAX, array_bit_rel)) {
-        fprintf(stderr, "Cannot setup_event_type for EV_REL/device [%s]: %s.\n", device, strerror(errno));
+    int uevent_fd = access("/run/udev/control", F_OK) == 0 ? uevent_open() : -1;
+    if (ioctl(fdo, UI_DEV_CREATE) < 0) {
+        fprintf(stderr, "Cannot create device: %s.\n", strerror(errno));
+        if (uevent_fd >= 0) {
+            close(uevent_fd);
+        }
         close(fdo);
-        close(fdi);
+        close_devices(devices, n_devices);
         return EXIT_FAILURE;
     }
 
-    if(!setup_event_type(fdo, UI_SET_ABSBIT, ABS_MAX, array_bit_abs)) {
-        fprintf(stderr, "Cannot setup_event_type for EV_ABS/device [%s]: %s.\n", device, strerror(errno));
-        close(fdo);
-        close(fdi);
-        return EXIT_FAILURE;
+    // Wait for device to be ready
+    wait_device_ready(fdo, uevent_fd);
+    //the virtual device repeats at the rate of the first keyboard, or at the kernel default
+    for (int i = 0; repeatVirtual && i < n_devices; i++) {
+        if (devices[i].has_rep) {
+            struct input_event rate[2] = {
+                { .type = EV_REP, .code = REP_DELAY, .value = (int) devices[i].rep[0] },
+                { .type = EV_REP, .code = REP_PERIOD, .value = (int) devices[i].rep[1] },
+            };
+            if (write(fdo, rate, sizeof rate) != sizeof rate) {
+                fprintf(stderr, "Info: Cannot set the repeat rate of the virtual device: %s.\n", strerror(errno));
+            }
+            break;
+        }
+    }
+    if (shared && uevent_fd >= 0) {
+        hotplug_fd = uevent_fd;
+    } else if (shared) {
+        fprintf(stderr, "Info: udev is not running, keyboards that are plugged in later are not picked up.\n");
+    } else if (uevent_fd >= 0) {
+        close(uevent_fd);
     }
 
-    if(!setup_event_type(fdo, UI_SET_MSCBIT, MSC_MAX, array_bit_msc)) {
-        fprintf(stderr, "Cannot setup_event_type for MSC_MAX/device [%s]: %s.\n", device, strerror(errno));
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        fprintf(stderr, "Cannot create epoll instance: %s.\n", strerror(errno));
         close(fdo);
-        close(fdi);
+        close_devices(devices, n_devices);
         return EXIT_FAILURE;
     }
 
-    if (ioctl(fdo, UI_DEV_CREATE) < 0) {
-        fprintf(stderr, "Cannot create device: %s.\n", strerror(errno));
+    //any instance that fails here does not leave a file behind
+    if (!stats_open(stats_path)) {
+        close(epfd);
         close(fdo);
-        close(fdi);
+        close_devices(devices, n_devices);
         return EXIT_FAILURE;
     }
 
-    // Wait for device to be ready
-    usleep(200000);
+    //the epoll fd stays for everything but the keyboards, the ring polls it
+    if (ioUring && writerThread) {
+        fprintf(stderr, "Info: The writer thread does not use io_uring, using epoll.\n");
+        ioUring = false;
+    }
+    if (ioUring && !uring_open(&ring, 4 * MAX_DEVICES, ioUringPoll)) {
+        fprintf(stderr, "Info: io_uring is not available, using epoll: %s.\n", strerror(errno));
+    } else if (ioUring) {
+        uring_devices = devices;
+        arm_poll(epfd);
+    }
 
-    if (ioctl(fdi, EVIOCGRAB, 1) < 0) {
-        fprintf(stderr, "Cannot grab key: %s.\n", strerror(errno));
-        close(fdo);
-        close(fdi);
-        return EXIT_FAILURE;
+    int n_active = 0;
+    for (int i = 0; i < n_devices; i++) {
+        if (start_device(epfd, &devices[i])) {
+            n_active++;
+        }
     }
 
-    struct input_event ev = {0};
-    int l_alt =0,
-        mod_state = 0,
-        array_qwerty_counter = 0;
-    bool disable_mapping = false;
-    unsigned int array_qwerty[MAX_LENGTH] = {0};
+    struct epoll_event hotplug_event = { .events = EPOLLIN, .data.ptr = &hotplug_fd };
+    if (hotplug_fd >= 0 && epoll_ctl(epfd, EPOLL_CTL_ADD, hotplug_fd, &hotplug_event) < 0) {
+        fprintf(stderr, "Info: Keyboards that are plugged in later are not picked up: %s.\n", strerror(errno));
+    }
 
-    fprintf(stderr, "Staring event loop with keyboard: [%s] for device [%s].\n", keyboard_name, device);
+    //only the directories of devices that are gone are watched, /dev/input for directories that come back
+    if (reattachMs > 0) {
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        struct epoll_event inotify_event = { .events = EPOLLIN, .data.ptr = &inotify_fd };
+        if (inotify_fd < 0 || inotify_add_watch(inotify_fd, "/dev/input", IN_CREATE | IN_MOVED_TO | IN_ATTRIB) < 0 ||
+            epoll_ctl(epfd, EPOLL_CTL_ADD, inotify_fd, &inotify_event) < 0) {
+            fprintf(stderr, "Info: Devices that are gone are not grabbed again: %s.\n", strerror(errno));
+            if (inotify_fd >= 0) {
+                close(inotify_fd);
+                inotify_fd = -1;
+            }
+        }
+    }
 
-    while (keep_running) {
-        ssize_t n = read(fdi, &ev, sizeof ev);
-        if (n == (ssize_t) -1) {
-            if (errno == EINTR)
-                continue;
-            break;
-        } else if (n != sizeof ev) {
-            break;
+    //without it a tap-hold key is only decided by the next key or its release
+    timer_fd = timerfd_create(eventClock, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct epoll_event timer_event = { .events = EPOLLIN, .data.ptr = &timer_fd };
+    if (timer_fd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, timer_fd, &timer_event) < 0) {
+        fprintf(stderr, "Info: Tap-hold keys are not held until another key is pressed: %s.\n", strerror(errno));
+        if (timer_fd >= 0) {
+            close(timer_fd);
+            timer_fd = -1;
         }
+    }
 
-        if (!noToggle && ev.code == KEY_LEFTALT) {
-            if (ev.value == 1 && ++l_alt >= 3) {
-                disable_mapping = !disable_mapping;
-                l_alt = 0;
-                fprintf(stdout, "mapping is set to [%s]\n", !disable_mapping ? "true" : "false");
-            }
-        } else if (ev.type == EV_KEY) {
-            l_alt = 0;
+    if (n_active == 0 && hotplug_fd < 0) {
+        stats_close();
+        close(epfd);
+        close(fdo);
+        return EXIT_FAILURE;
+    }
+
+    struct epoll_event output_event = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fdo, &output_event) < 0) {
+        fprintf(stderr, "Info: LED state is not forwarded: %s.\n", strerror(errno));
+    }
+
+    if (control_path != NULL) {
+        control_fd = control_open(control_path);
+        struct epoll_event control_event = { .events = EPOLLIN, .data.ptr = &control_fd };
+        if (control_fd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, control_fd, &control_event) < 0) {
+            fprintf(stderr, "Error: Cannot listen on control socket [%s]: %s.\n", control_path, strerror(errno));
         }
+    }
 
-        if(!disable_mapping && ev.type == EV_KEY) {
-            int mod_current = modifier_bit(ev.code);
+    //the writer thread keeps the normal scheduling policy, whatever realtime_setup() does
+    log_start();
+    //after all devices are open, so their buffers are locked as well
+    realtime_setup(&rt);
+    //after realtime_setup(), the writer runs with the policy of the event loop
+    if (writerThread && !(writerStarted = output_start(fdo, eventClock))) {
+        log_printf(LOG_LEVEL_INFO, "Info: Cannot start the writer thread, writing from the event loop: %s.\n",
+                   strerror(errno));
+    }
 
-            if(noCapsLockAsModifier && mod_current == modifier_bit(KEY_CAPSLOCK)) {
-                mod_current = 0;
+    //in shared mode the virtual device stays when the last keyboard is gone, and with --reattach while one
+    //of them may come back
+    int timeout = -1;
+    while (keep_running && (n_active > 0 || hotplug_fd >= 0 || timeout >= 0)) {
+        struct epoll_event events[MAX_DEVICES];
+        int n = 0, wait = next_timeout(timeout, send_probe(fdo));
+        if (ring.fd < 0) {
+            n = epoll_wait(epfd, events, MAX_DEVICES, wait);
+        } else {
+            //submits the writes of the last round and waits, one system call
+            int ret = submit_round(1, wait);
+            if (ret < 0 && ret != -EINTR && ret != -ETIME) {
+                fprintf(stderr, "Error: Cannot wait for io_uring: %s.\n", strerror(-ret));
+                break;
             }
-
-            if (mod_current > 0) {
-                if (ev.value != 0) {
-                    //set mod state when either 1 (key press), or 2 (repeat)
-                    mod_state |= mod_current;
-                } else {
-                    //remove mod state when 0 (released)
-                    mod_state &= ~mod_current;
-                }
+        }
+        if (report_latency) {
+            report_latency = 0;
+            for (int i = 0; i < n_devices; i++) {
+                latency_report(devices[i].path, &devices[i].latency);
+            }
+        }
+        if (reload_config) {
+            reload_config = 0;
+            struct settings next;
+            if (load_settings(&next)) {
+                prepare_settings(&next);
             }
+        }
+        if (n < 0 && errno != EINTR) {
+            break;
+        }
 
-            int qwerty_code = qwerty2dvorak(ev.code);
-            if (ev.code != qwerty_code) {
-                //pressed key
-                if (ev.value == 1) {
-                    //modifier pressed
-                    if(mod_state > 0) {
-                        if (array_qwerty_counter == MAX_LENGTH) {
-                            printf("warning, too many keys pressed: %d. %s 0x%04x (%d), arr:%d\n",
-                                MAX_LENGTH, ev.value == 1 ? "pressed" : "released", (int) ev.code, (int) ev.code,
-                                array_qwerty_counter);
-                        } else {
-                            array_qwerty[array_qwerty_counter++] = qwerty_code;
-                            //remap to qwerty - press key
-                            emit(fdo, ev.type, qwerty_code, ev.value, ev.time);
-                        }
-                    } else {
-                        //no modifier
-                        emit(fdo, ev.type, ev.code, ev.value, ev.time);
-                    }
-                } else if(ev.value == 2) {
-                    //repeating button
-                    bool is_in_array = false;
-                    for (int i = 0; i < array_qwerty_counter; i++) {
-                        if (array_qwerty[i] == qwerty_code) {
-                            is_in_array = true;
-                            break;
-                        }
-                    }
-                    if(is_in_array) {
-                        //this is a repeating qwerty
-                        emit(fdo, ev.type, qwerty_code, ev.value, ev.time);
-                    } else {
-                        //not in the array, regular key
-                        emit(fdo, ev.type, ev.code, ev.value, ev.time);
-                    }
-                } else if(ev.value == 0) {
-                    //release the key
-                    bool need_emit = false;
-                    for (int i = 0; i < array_qwerty_counter; i++) {
-                        if (array_qwerty[i] == qwerty_code) {
-                            array_qwerty[i] = 0;
-                            need_emit = true;
-                            break;
-                        }
-                    }
-                    if(need_emit) {
-                        int last_nonzero = -1;
-                        for (int i = 0; i < array_qwerty_counter; i++) {
-                            if (array_qwerty[i] != 0) {
-                                last_nonzero = i;
-                            }
-                        }
-                        array_qwerty_counter = last_nonzero + 1;
-                        //remap to qwerty - release key
-                        emit(fdo, ev.type, qwerty_code, ev.value, ev.time);
-                    } else {
-                        //regular dvorak key
-                        emit(fdo, ev.type, ev.code, ev.value, ev.time);
-                    }
-                } else {
-                    //this should not happen
-                    emit(fdo, ev.type, ev.code, ev.value, ev.time);
-                }
-            } else {
-                //regular dvorak key
-                emit(fdo, ev.type, ev.code, ev.value, ev.time);
+        if (ring.fd >= 0) {
+            reap(epfd, fdo, devices, &n_devices, &n_active, &caps);
+        }
+        dispatch(epfd, fdo, events, n, devices, &n_devices, &n_active, &caps);
+        if (writerStarted) {
+            if (output_dropped() && output_resync()) {
+                resync_output(fdo, devices, n_devices);
             }
-        } else {
-            //non regular key
-            emit(fdo, ev.type, ev.code, ev.value, ev.time);
+            unsigned long failed = output_failed();
+            if (failed > 0) {
+                log_printf(LOG_LEVEL_INFO, "Info: %lu writes to the virtual device failed.\n", failed);
+            }
+        }
+        //between two reads, so no frame is split
+        if (has_pending) {
+            apply_pending(epfd, devices, n_devices, &n_active);
         }
+        if (focus_next != NULL) {
+            apply_focus(devices, n_devices);
+        }
+        timeout = expire_devices(devices, n_devices);
+        arm_timer(devices, n_devices);
+    }
+    output_stop();
+    log_stop();
+    if (control_fd >= 0) {
+        close(control_fd);
+        unlink(control_path);
+    }
+    if (hotplug_fd >= 0) {
+        close(hotplug_fd);
+    }
+    if (inotify_fd >= 0) {
+        close(inotify_fd);
     }
-    close(fdi);
+    if (timer_fd >= 0) {
+        close(timer_fd);
+    }
+    //the releases of a device that went away in the last round
+    if (ring.fd >= 0) {
+        drain_writes();
+    }
+    close_devices(devices, n_devices);
+    if (ring.fd >= 0) {
+        uring_close(&ring);
+    }
+    stats_close();
+    close(epfd);
     close(fdo);
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
@@ -0,0 +1,185 @@
+/*
+ * Copyright 2018 Thomas Bocek
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ */
+
+/*
+ * HID-BPF loader
+ * ==============
+ *
+ * Finds the HID device of an evdev node through sysfs, checks that it sends boot protocol
+ * reports, and loads dvorak.bpf.c for it with the mapping of the layout translated from key
+ * codes to HID usages. The program stays attached as long as the link is held. Without
+ * HID_BPF=1 this file only contains stubs and every device takes the userspace path.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include "hidbpf.h"
+
+#ifdef HAVE_HID_BPF
+#include <fcntl.h>
+#include <unistd.h>
+#include <bpf/libbpf.h>
+#include "dvorak.skel.h"
+
+//key codes of the HID keyboard usages 0x00-0x67, as in hid_keyboard[] of drivers/hid/hid-input.c
+#define HID_USAGES 0x68
+static const unsigned char hid_keyboard[HID_USAGES] = {
+      0,  0,  0,  0, 30, 48, 46, 32, 18, 33, 34, 35, 23, 36, 37, 38,
+     50, 49, 24, 25, 16, 19, 31, 20, 22, 47, 17, 45, 21, 44,  2,  3,
+      4,  5,  6,  7,  8,  9, 10, 11, 28,  1, 14, 15, 57, 12, 13, 26,
+     27, 43, 43, 39, 40, 41, 51, 52, 53, 58, 59, 60, 61, 62, 63, 64,
+     65, 66, 67, 68, 87, 88, 99, 70,119,110,102,104,111,107,109,106,
+    105,108,103, 69, 98, 55, 74, 78, 96, 79, 80, 81, 75, 76, 77, 71,
+     72, 73, 82, 83, 86,127,116,117,
+};
+
+struct hidbpf {
+    struct dvorak_bpf *skel;
+    struct bpf_link *link;
+};
+
+//the HID device id is the last part of its sysfs name, e.g. 0003:046D:C52B.0003
+//hid_path needs room for PATH_MAX bytes
+static int hid_device(const char *path, char *hid_path) {
+    char node[PATH_MAX], link[PATH_MAX + 32];
+    if (realpath(path, node) == NULL) {
+        return -1;
+    }
+    const char *event = strrchr(node, '/');
+    snprintf(link, sizeof link, "/sys/class/input/%s/device/device", event != NULL ? event + 1 : node);
+    if (realpath(link, hid_path) == NULL) {
+        return -1;
+    }
+    const char *name = strrchr(hid_path, '/');
+    unsigned int bus, vendor, product, id;
+    if (name == NULL || sscanf(name + 1, "%x:%x:%x.%x", &bus, &vendor, &product, &id) != 4) {
+        errno = ENODEV;
+        return -1;
+    }
+    return (int) id;
+}
+
+//a keyboard that sends boot protocol reports: usage keyboard from the generic desktop page and no report ids
+static bool boot_keyboard(const char *hid_path) {
+    char path[PATH_MAX + 32];
+    unsigned char desc[4096];
+    snprintf(path, sizeof path, "%s/report_descriptor", hid_path);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    ssize_t n = read(fd, desc, sizeof desc);
+    close(fd);
+    if (n < 4 || desc[0] != 0x05 || desc[1] != 0x01 || desc[2] != 0x09 || desc[3] != 0x06) {
+        return false;
+    }
+    //short items: the low two bits are the size (3 means 4 bytes), the rest is the tag
+    for (ssize_t i = 0; i < n;) {
+        int item = desc[i], size = (item & 3) == 3 ? 4 : item & 3;
+        if (item == 0xfe) {
+            //long item, not used by keyboards
+            return false;
+        }
+        if ((item & 0xfc) == 0x84) {
+            return false;
+        }
+        i += 1 + size;
+    }
+    return true;
+}
+
+struct hidbpf *hidbpf_attach(const char *path, const struct remap_config *config) {
+    //the program only knows the layout
+    if (config->rules != NULL) {
+        errno = ENOTSUP;
+        return NULL;
+    }
+    char hid_path[PATH_MAX];
+    int id = hid_device(path, hid_path);
+    if (id < 0) {
+        return NULL;
+    }
+    if (!boot_keyboard(hid_path)) {
+        errno = ENOTSUP;
+        return NULL;
+    }
+
+    struct dvorak_bpf *skel = dvorak_bpf__open();
+    if (skel == NULL) {
+        return NULL;
+    }
+    skel->struct_ops.dvorak->hid_id = id;
+    skel->rodata->caps_lock_modifier = config->modifier_bits[KEY_CAPSLOCK] != 0;
+    skel->rodata->toggle = !config->no_toggle;
+    for (int usage = 0; usage < 256; usage++) {
+        skel->rodata->usage_map[usage] = usage;
+    }
+    for (int usage = 0; usage < HID_USAGES; usage++) {
+        int key = hid_keyboard[usage], qwerty = layout_key(config->layout, key);
+        for (int target = 0; key != 0 && qwerty != key && target < HID_USAGES; target++) {
+            if (hid_keyboard[target] == qwerty) {
+                skel->rodata->usage_map[usage] = target;
+                break;
+            }
+        }
+    }
+
+    if (dvorak_bpf__load(skel) < 0) {
+        dvorak_bpf__destroy(skel);
+        return NULL;
+    }
+    struct bpf_link *link = bpf_map__attach_struct_ops(skel->maps.dvorak);
+    if (link == NULL) {
+        dvorak_bpf__destroy(skel);
+        return NULL;
+    }
+    struct hidbpf *bpf = malloc(sizeof *bpf);
+    if (bpf == NULL) {
+        bpf_link__destroy(link);
+        dvorak_bpf__destroy(skel);
+        return NULL;
+    }
+    bpf->skel = skel;
+    bpf->link = link;
+    return bpf;
+}
+
+void hidbpf_detach(struct hidbpf *bpf) {
+    if (bpf != NULL) {
+        bpf_link__destroy(bpf->link);
+        dvorak_bpf__destroy(bpf->skel);
+        free(bpf);
+    }
+}
+
+#else
+
+struct hidbpf *hidbpf_attach(const char *path, const struct remap_config *config) {
+    (void) path;
+    (void) config;
+    errno = ENOSYS;
+    return NULL;
+}
+
+void hidbpf_detach(struct hidbpf *bpf) {
+    (void) bpf;
+}
+
+#endif
@@ -0,0 +1,31 @@
+/*
+ * Copyright 2018 Thomas Bocek
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ */
+
+#ifndef HIDBPF_H
+#define HIDBPF_H
+
+#include "remap.h"
+
+//the in-kernel remapping of one keyboard, see dvorak.bpf.c
+struct hidbpf;
+
+//attaches the remapping to the HID device behind the evdev node at path. NULL with errno set
+//if the kernel, the device, or this build does not support it, then the device is grabbed instead.
+struct hidbpf *hidbpf_attach(const char *path, const struct remap_config *config);
+void hidbpf_detach(struct hidbpf *bpf);
+
+#endif
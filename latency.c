@@ -0,0 +1,47 @@
+/*
+ * Copyright 2018 Thomas Bocek
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ */
+
+#include "latency.h"
+#include "log.h"
+
+static uint64_t bucket_lower(int bucket) {
+    if (bucket < 4) {
+        return bucket;
+    }
+    int msb = bucket / 4 + 1;
+    return (uint64_t) (4 + bucket % 4) << (msb - 2);
+}
+
+uint64_t latency_percentile(const struct latency *latency, double fraction) {
+    uint64_t rank = (uint64_t) (fraction * latency->count + 0.5), seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += latency->buckets[i];
+        if (seen >= rank && seen > 0) {
+            uint64_t upper = i + 1 < LATENCY_BUCKETS ? bucket_lower(i + 1) : latency->max_ns;
+            return upper < latency->max_ns ? upper : latency->max_ns;
+        }
+    }
+    return latency->max_ns;
+}
+
+void latency_report(const char *name, const struct latency *latency) {
+    log_printf(LOG_LEVEL_INFO, "Latency of [%s]: frames=%llu p50=%.1fus p99=%.1fus max=%.1fus\n", name,
+            (unsigned long long) latency->count,
+            latency_percentile(latency, 0.5) / 1000.0,
+            latency_percentile(latency, 0.99) / 1000.0,
+            latency->max_ns / 1000.0);
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright 2018 Thomas Bocek
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ */
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+
+//4 buckets per power of two, the last bucket collects everything above 2^40 ns
+#define LATENCY_BUCKETS 160
+
+//fixed size histogram of the time from the kernel timestamp of an event until its frame was written to uinput
+struct latency {
+    uint64_t count,
+             max_ns,
+             buckets[LATENCY_BUCKETS];
+};
+
+static inline int latency_bucket(uint64_t ns) {
+    if (ns < 4) {
+        return (int) ns;
+    }
+    int msb = 63 - __builtin_clzll(ns);
+    int bucket = (msb - 1) * 4 + (int) ((ns >> (msb - 2)) & 3);
+    return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+static inline void latency_record(struct latency *latency, uint64_t ns) {
+    latency->count++;
+    latency->buckets[latency_bucket(ns)]++;
+    if (ns > latency->max_ns) {
+        latency->max_ns = ns;
+    }
+}
+
+//upper bound of the bucket that contains the given fraction of all samples
+uint64_t latency_percentile(const struct latency *latency, double fraction);
+//through log_printf(), the event loop does not block on stderr
+void latency_report(const char *name, const struct latency *latency);
+
+#endif
@@ -0,0 +1,346 @@
+/*
+ * Copyright 2018 Thomas Bocek
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ */
+
+/*
+ * Layout files
+ * ============
+ *
+ * Besides the built in layouts, a layout can be described in a text file, one key per line:
+ *
+ *   # key of the layout    key that produces the qwerty character at this position
+ *   KEY_Q                  KEY_X
+ *   w                      comma
+ *
+ * Key names can be written with or without KEY_ and in any case, or as a number. Parsing the
+ * file is only done once: the compiled table is stored as FILE.cache next to the text file,
+ * together with the mtime, size, and inode of the text file. As long as these match, the
+ * cache is mapped with mmap() and used as it is.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <linux/input.h>
+#include "layout.h"
+#include "log.h"
+
+//from: https://github.com/kentonv/dvorak-qwerty/tree/master/unix
+#define DVORAK_KEYS(X) \
+    X(KEY_MINUS, KEY_APOSTROPHE) \
+    X(KEY_EQUAL, KEY_RIGHTBRACE) \
+    X(KEY_Q, KEY_X) \
+    X(KEY_W, KEY_COMMA) \
+    X(KEY_E, KEY_D) \
+    X(KEY_R, KEY_O) \
+    X(KEY_T, KEY_K) \
+    X(KEY_Y, KEY_T) \
+    X(KEY_U, KEY_F) \
+    X(KEY_I, KEY_G) \
+    X(KEY_O, KEY_S) \
+    X(KEY_P, KEY_R) \
+    X(KEY_LEFTBRACE, KEY_MINUS) \
+    X(KEY_RIGHTBRACE, KEY_EQUAL) \
+    X(KEY_A, KEY_A) \
+    X(KEY_S, KEY_SEMICOLON) \
+    X(KEY_D, KEY_H) \
+    X(KEY_F, KEY_Y) \
+    X(KEY_G, KEY_U) \
+    X(KEY_H, KEY_J) \
+    X(KEY_J, KEY_C) \
+    X(KEY_K, KEY_V) \
+    X(KEY_L, KEY_P) \
+    X(KEY_SEMICOLON, KEY_Z) \
+    X(KEY_APOSTROPHE, KEY_Q) \
+    X(KEY_Z, KEY_SLASH) \
+    X(KEY_X, KEY_B) \
+    X(KEY_C, KEY_I) \
+    X(KEY_V, KEY_DOT) \
+    X(KEY_B, KEY_N) \
+    X(KEY_N, KEY_L) \
+    X(KEY_M, KEY_M) \
+    X(KEY_COMMA, KEY_W) \
+    X(KEY_DOT, KEY_E) \
+    X(KEY_SLASH, KEY_LEFTBRACE)
+
+#define COLEMAK_KEYS(X) \
+    X(KEY_E, KEY_K) \
+    X(KEY_R, KEY_S) \
+    X(KEY_T, KEY_F) \
+    X(KEY_Y, KEY_O) \
+    X(KEY_U, KEY_I) \
+    X(KEY_I, KEY_L) \
+    X(KEY_O, KEY_SEMICOLON) \
+    X(KEY_P, KEY_R) \
+    X(KEY_S, KEY_D) \
+    X(KEY_D, KEY_G) \
+    X(KEY_F, KEY_E) \
+    X(KEY_G, KEY_T) \
+    X(KEY_J, KEY_Y) \
+    X(KEY_K, KEY_N) \
+    X(KEY_L, KEY_U) \
+    X(KEY_SEMICOLON, KEY_P) \
+    X(KEY_N, KEY_J)
+
+#define WORKMAN_KEYS(X) \
+    X(KEY_W, KEY_R) \
+    X(KEY_E, KEY_K) \
+    X(KEY_R, KEY_E) \
+    X(KEY_T, KEY_F) \
+    X(KEY_Y, KEY_H) \
+    X(KEY_U, KEY_I) \
+    X(KEY_I, KEY_SEMICOLON) \
+    X(KEY_O, KEY_L) \
+    X(KEY_P, KEY_O) \
+    X(KEY_D, KEY_W) \
+    X(KEY_F, KEY_U) \
+    X(KEY_H, KEY_D) \
+    X(KEY_J, KEY_Y) \
+    X(KEY_K, KEY_N) \
+    X(KEY_L, KEY_M) \
+    X(KEY_SEMICOLON, KEY_P) \
+    X(KEY_C, KEY_V) \
+    X(KEY_V, KEY_B) \
+    X(KEY_B, KEY_T) \
+    X(KEY_N, KEY_J) \
+    X(KEY_M, KEY_C)
+
+//the tables and the remap bitmaps are generated by the compiler from the key lists above
+#define LAYOUT_MAP(from, to) [from] = to,
+#define LAYOUT_BIT_LOW(from, to) | ((from) != (to) && (from) < 64 ? 1ULL << ((from) % 64) : 0)
+#define LAYOUT_BIT_HIGH(from, to) | ((from) != (to) && (from) >= 64 ? 1ULL << ((from) % 64) : 0)
+#define LAYOUT(name, keys) \
+    { name, { keys(LAYOUT_MAP) }, { 0 keys(LAYOUT_BIT_LOW), 0 keys(LAYOUT_BIT_HIGH) } }
+
+static const struct layout layouts[] = {
+    LAYOUT("dvorak", DVORAK_KEYS),
+    LAYOUT("colemak", COLEMAK_KEYS),
+    LAYOUT("workman", WORKMAN_KEYS),
+};
+
+#define LAYOUT_NAME(key) [KEY_##key] = #key,
+#define LAYOUT_KEY_NAMES(NAME) \
+    NAME(ESC) NAME(1) NAME(2) NAME(3) NAME(4) NAME(5) NAME(6) NAME(7) NAME(8) NAME(9) NAME(0) NAME(MINUS) NAME(EQUAL) NAME(BACKSPACE) NAME(TAB) NAME(Q) NAME(W) \
+    NAME(E) NAME(R) NAME(T) NAME(Y) NAME(U) NAME(I) NAME(O) NAME(P) NAME(LEFTBRACE) NAME(RIGHTBRACE) NAME(ENTER) NAME(LEFTCTRL) NAME(A) NAME(S) NAME(D) \
+    NAME(F) NAME(G) NAME(H) NAME(J) NAME(K) NAME(L) NAME(SEMICOLON) NAME(APOSTROPHE) NAME(GRAVE) NAME(LEFTSHIFT) NAME(BACKSLASH) NAME(Z) NAME(X) NAME(C) \
+    NAME(V) NAME(B) NAME(N) NAME(M) NAME(COMMA) NAME(DOT) NAME(SLASH) NAME(RIGHTSHIFT) NAME(KPASTERISK) NAME(LEFTALT) NAME(SPACE) NAME(CAPSLOCK) \
+    NAME(F1) NAME(F2) NAME(F3) NAME(F4) NAME(F5) NAME(F6) NAME(F7) NAME(F8) NAME(F9) NAME(F10) NAME(NUMLOCK) NAME(SCROLLLOCK) NAME(KP7) NAME(KP8) NAME(KP9) \
+    NAME(KPMINUS) NAME(KP4) NAME(KP5) NAME(KP6) NAME(KPPLUS) NAME(KP1) NAME(KP2) NAME(KP3) NAME(KP0) NAME(KPDOT) NAME(ZENKAKUHANKAKU) NAME(102ND) \
+    NAME(F11) NAME(F12) NAME(RO) NAME(KATAKANA) NAME(HIRAGANA) NAME(HENKAN) NAME(KATAKANAHIRAGANA) NAME(MUHENKAN) NAME(KPJPCOMMA) \
+    NAME(KPENTER) NAME(RIGHTCTRL) NAME(KPSLASH) NAME(SYSRQ) NAME(RIGHTALT) NAME(LINEFEED) NAME(HOME) NAME(UP) NAME(PAGEUP) NAME(LEFT) \
+    NAME(RIGHT) NAME(END) NAME(DOWN) NAME(PAGEDOWN) NAME(INSERT) NAME(DELETE) NAME(MACRO) NAME(MUTE) NAME(VOLUMEDOWN) NAME(VOLUMEUP) \
+    NAME(POWER) NAME(KPEQUAL) NAME(KPPLUSMINUS) NAME(PAUSE) NAME(SCALE) NAME(KPCOMMA) NAME(HANGEUL) NAME(HANJA) NAME(YEN) NAME(LEFTMETA) \
+    NAME(RIGHTMETA) NAME(COMPOSE)
+
+static const char *const key_names[LAYOUT_KEYS] = { LAYOUT_KEY_NAMES(LAYOUT_NAME) };
+
+#define LAYOUT_CACHE_MAGIC 0x50414d4b56440001ULL
+
+struct layout_cache {
+    uint64_t magic;
+    //the text file the cache was compiled from
+    int64_t mtime_sec,
+            mtime_nsec,
+            size;
+    uint64_t ino;
+    uint64_t checksum;
+    struct layout layout;
+};
+
+uint64_t layout_checksum(const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ p[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+int key_code(const char *name) {
+    if (strncasecmp(name, "KEY_", 4) == 0) {
+        name += 4;
+    }
+    if (isdigit((unsigned char) name[0])) {
+        char *end;
+        long code = strtol(name, &end, 0);
+        //single digits are key names, KEY_1 is not code 1
+        if (*end == '\0' && name[1] != '\0') {
+            return code > 0 && code < LAYOUT_KEYS ? (int) code : -1;
+        }
+    }
+    for (int i = 1; i < LAYOUT_KEYS; i++) {
+        if (key_names[i] != NULL && strcasecmp(key_names[i], name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static bool parse_layout(const char *path, struct layout *layout) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        log_printf(LOG_LEVEL_ERROR, "Error: Cannot open layout [%s]: %s.\n", path, strerror(errno));
+        return false;
+    }
+
+    memset(layout, 0, sizeof *layout);
+    const char *basename = strrchr(path, '/');
+    basename = basename ? basename + 1 : path;
+    snprintf(layout->name, sizeof layout->name, "%.*s", (int) strcspn(basename, "."), basename);
+
+    char line[256];
+    int line_nr = 0;
+    bool ok = true;
+    while (fgets(line, sizeof line, file) != NULL) {
+        line_nr++;
+        line[strcspn(line, "#\n")] = '\0';
+        char from[64], to[64], rest[2];
+        int n = sscanf(line, "%63s %63s %1s", from, to, rest);
+        if (n <= 0) {
+            continue;
+        }
+        int code_from = n == 2 ? key_code(from) : -1,
+            code_to = n == 2 ? key_code(to) : -1;
+        if (code_from < 0 || code_to < 0) {
+            log_printf(LOG_LEVEL_ERROR, "Error: %s:%d: expected two known keys.\n", path, line_nr);
+            ok = false;
+            continue;
+        }
+        layout->map[code_from] = code_to;
+        if (code_from != code_to) {
+            layout->remap[code_from / 64] |= 1ULL << (code_from % 64);
+        } else {
+            layout->remap[code_from / 64] &= ~(1ULL << (code_from % 64));
+        }
+    }
+    fclose(file);
+    return ok;
+}
+
+static const struct layout *map_cache(const char *cache_path, const struct stat *st) {
+    int fd = open(cache_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat cache_st;
+    if (fstat(fd, &cache_st) < 0 || cache_st.st_size != sizeof(struct layout_cache)) {
+        close(fd);
+        return NULL;
+    }
+    const struct layout_cache *cache = mmap(NULL, sizeof *cache, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (cache == MAP_FAILED) {
+        return NULL;
+    }
+    if (cache->magic != LAYOUT_CACHE_MAGIC ||
+        cache->mtime_sec != st->st_mtim.tv_sec ||
+        cache->mtime_nsec != st->st_mtim.tv_nsec ||
+        cache->size != st->st_size ||
+        cache->ino != st->st_ino ||
+        cache->checksum != layout_checksum(&cache->layout, sizeof cache->layout)) {
+        munmap((void *) cache, sizeof *cache);
+        return NULL;
+    }
+    return &cache->layout;
+}
+
+static void write_cache(const char *cache_path, const struct stat *st, const struct layout *layout) {
+    struct layout_cache cache = {
+        .magic = LAYOUT_CACHE_MAGIC,
+        .mtime_sec = st->st_mtim.tv_sec,
+        .mtime_nsec = st->st_mtim.tv_nsec,
+        .size = st->st_size,
+        .ino = st->st_ino,
+        .layout = *layout,
+    };
+    cache.checksum = layout_checksum(&cache.layout, sizeof cache.layout);
+
+    //several instances may compile the same layout at once, the rename makes the cache appear atomically
+    char tmp_path[PATH_MAX + 16];
+    snprintf(tmp_path, sizeof tmp_path, "%s.%d", cache_path, (int) getpid());
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        log_printf(LOG_LEVEL_INFO, "Info: Cannot write layout cache [%s]: %s.\n", cache_path, strerror(errno));
+        return;
+    }
+    bool ok = write(fd, &cache, sizeof cache) == sizeof cache;
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(tmp_path, cache_path) < 0) {
+        log_printf(LOG_LEVEL_INFO, "Info: Cannot write layout cache [%s]: %s.\n", cache_path, strerror(errno));
+        unlink(tmp_path);
+    }
+}
+
+const struct layout *load_layout(const char *path) {
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        log_printf(LOG_LEVEL_ERROR, "Error: Cannot open layout [%s]: %s.\n", path, strerror(errno));
+        return NULL;
+    }
+
+    char cache_path[PATH_MAX];
+    if (snprintf(cache_path, sizeof cache_path, "%s.cache", path) >= (int) sizeof cache_path) {
+        log_printf(LOG_LEVEL_ERROR, "Error: Layout path [%s] is too long.\n", path);
+        return NULL;
+    }
+    const struct layout *cached = map_cache(cache_path, &st);
+    if (cached != NULL) {
+        return cached;
+    }
+
+    //a loaded layout always lives in a mapping of a whole cache, so free_layout() does not need to know where it came from
+    struct layout_cache *fresh = mmap(NULL, sizeof *fresh, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (fresh == MAP_FAILED) {
+        return NULL;
+    }
+    if (!parse_layout(path, &fresh->layout)) {
+        munmap(fresh, sizeof *fresh);
+        return NULL;
+    }
+    write_cache(cache_path, &st, &fresh->layout);
+    return &fresh->layout;
+}
+
+void free_layout(const struct layout *layout) {
+    if (layout == NULL || (layout >= layouts && layout < layouts + sizeof layouts / sizeof layouts[0])) {
+        return;
+    }
+    const struct layout_cache *cache = (const void *) ((const char *) layout - offsetof(struct layout_cache, layout));
+    munmap((void *) cache, sizeof *cache);
+}
+
+const struct layout *find_layout(const char *name) {
+    if (strchr(name, '/') != NULL) {
+        return load_layout(name);
+    }
+    for (size_t i = 0; i < sizeof layouts / sizeof layouts[0]; i++) {
+        if (strcmp(layouts[i].name, name) == 0) {
+            return &layouts[i];
+        }
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof path, "%s/%s.map", LAYOUT_DIR, name);
+    return load_layout(path);
+}
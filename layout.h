@@ -0,0 +1,56 @@
+/*
+ * Copyright 2018 Thomas Bocek
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ */
+
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//only keys below this code act as modifiers or get remapped, everything above is passed on without a lookup
+#define LAYOUT_KEYS 128
+//layouts that are not built in are looked up here as NAME.map
+#define LAYOUT_DIR "/etc/dvorak/layouts"
+
+//a layout maps the key of the active layout to the key that produces the qwerty character at the same position.
+//It contains no pointers, so it can be mapped from the binary cache as it is.
+struct layout {
+    char name[32];
+    uint16_t map[LAYOUT_KEYS];
+    //bit is set if map[] changes the key, all other keys are emitted as they are
+    uint64_t remap[LAYOUT_KEYS / 64];
+};
+
+static inline int layout_key(const struct layout *layout, unsigned int key) {
+    if (key < LAYOUT_KEYS && (layout->remap[key / 64] & (1ULL << (key % 64)))) {
+        return layout->map[key];
+    }
+    return key;
+}
+
+//returns a built in layout, or loads NAME from LAYOUT_DIR or a path. NULL if there is no such layout.
+const struct layout *find_layout(const char *name);
+//releases a layout from find_layout() or load_layout(), built in layouts are left alone
+void free_layout(const struct layout *layout);
+//loads a layout text file, the compiled table is cached next to it in FILE.cache
+const struct layout *load_layout(const char *path);
+//FNV-1a, only protects against a truncated or otherwise broken cache file
+uint64_t layout_checksum(const void *data, size_t len);
+//returns the key code for a name such as "KEY_Q", "q", or "16", -1 if unknown
+int key_code(const char *name);
+
+#endif
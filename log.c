@@ -0,0 +1,215 @@
+/*
+ * Copyright 2018 Thomas Bocek
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ */
+
+/*
+ * Logging
+ * =======
+ *
+ * The event loop must never wait for stderr: under systemd it is a socket to the journal,
+ * which can be slow or full. log_printf() formats into a fixed-size record of a ring with
+ * one producer, the event loop, and one consumer, a writer thread with the normal
+ * scheduling policy that does the blocking writes. The same message in a row is counted
+ * instead of stored again, and a token bucket limits the rate. If the ring is full or the
+ * rate is exceeded, a record is dropped and the writer reports how many.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include "log.h"
+
+//the writer only formats one line at a time, and with -R mlockall() would lock a default stack of 8 MB
+#define LOG_STACK (64 * 1024)
+
+static struct log_record ring[LOG_RING];
+//head is written by the producer only, tail by the writer thread only
+static _Atomic unsigned int head, tail;
+static atomic_ulong dropped;
+static atomic_bool stopping;
+static int max_level = LOG_LEVEL_INFO;
+static int wake_fd = -1;
+static pthread_t writer;
+static bool started;
+
+//producer side only
+static char last_text[LOG_TEXT];
+static unsigned long repeats;
+static double tokens = LOG_BURST;
+static struct timespec refilled;
+
+//the journal reads the priority from a <N> prefix, see sd-daemon(3)
+static bool journal;
+static const char *const priorities[] = { "<3>", "<6>", "<7>" };
+
+static void write_record(const struct log_record *record) {
+    fprintf(stderr, "%s%s\n", journal ? priorities[record->level] : "", record->text);
+}
+
+static void *writer_main(void *arg) {
+    (void) arg;
+    for (;;) {
+        uint64_t value;
+        //blocks until the producer signals, a failed read just drains once more
+        if (read(wake_fd, &value, sizeof value) < 0) {
+            value = 0;
+        }
+        unsigned int t = atomic_load_explicit(&tail, memory_order_relaxed);
+        unsigned int h = atomic_load_explicit(&head, memory_order_acquire);
+        for (; t != h; t++) {
+            write_record(&ring[t % LOG_RING]);
+            atomic_store_explicit(&tail, t + 1, memory_order_release);
+        }
+        unsigned long lost = atomic_exchange(&dropped, 0);
+        if (lost > 0) {
+            fprintf(stderr, "Info: %lu log messages were dropped.\n", lost);
+        }
+        fflush(stderr);
+        if (atomic_load(&stopping)) {
+            return NULL;
+        }
+    }
+}
+
+static void push(int level, const char *text);
+
+//the count of the message before, once a different one comes
+static void flush_repeats(void) {
+    if (repeats > 0) {
+        char repeated[LOG_TEXT];
+        snprintf(repeated, sizeof repeated, "Info: Last message repeated %lu times.", repeats);
+        repeats = 0;
+        push(LOG_LEVEL_INFO, repeated);
+    }
+}
+
+void log_init(int level) {
+    max_level = level;
+}
+
+void log_start(void) {
+    journal = getenv("JOURNAL_STREAM") != NULL;
+    //the writer blocks in read(), a write() by the producer only blocks if the counter reaches 2^64
+    wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (wake_fd < 0) {
+        return;
+    }
+    //the writer must not inherit a realtime policy of the event loop
+    pthread_attr_t attr;
+    struct sched_param param = { .sched_priority = 0 };
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, LOG_STACK);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+    pthread_attr_setschedparam(&attr, &param);
+    started = pthread_create(&writer, &attr, writer_main, NULL) == 0;
+    pthread_attr_destroy(&attr);
+    //messages keep going to stderr directly
+    if (!started) {
+        close(wake_fd);
+        wake_fd = -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &refilled);
+}
+
+void log_stop(void) {
+    if (!started) {
+        return;
+    }
+    atomic_store(&stopping, true);
+    uint64_t one = 1;
+    write(wake_fd, &one, sizeof one);
+    pthread_join(writer, NULL);
+    //written here, the token bucket or a full ring would drop it
+    if (repeats > 0) {
+        struct log_record record = { .level = LOG_LEVEL_INFO };
+        snprintf(record.text, sizeof record.text, "Info: Last message repeated %lu times.", repeats);
+        repeats = 0;
+        write_record(&record);
+    }
+    close(wake_fd);
+    wake_fd = -1;
+    started = false;
+}
+
+static bool take_token(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    tokens += ((now.tv_sec - refilled.tv_sec) + (now.tv_nsec - refilled.tv_nsec) / 1e9) * LOG_RATE;
+    tokens = tokens > LOG_BURST ? LOG_BURST : tokens;
+    refilled = now;
+    if (tokens < 1) {
+        return false;
+    }
+    tokens -= 1;
+    return true;
+}
+
+static void push(int level, const char *text) {
+    if (!take_token()) {
+        atomic_fetch_add(&dropped, 1);
+        return;
+    }
+    unsigned int h = atomic_load_explicit(&head, memory_order_relaxed);
+    if (h - atomic_load_explicit(&tail, memory_order_acquire) == LOG_RING) {
+        atomic_fetch_add(&dropped, 1);
+        return;
+    }
+    struct log_record *record = &ring[h % LOG_RING];
+    record->level = level;
+    snprintf(record->text, sizeof record->text, "%s", text);
+    atomic_store_explicit(&head, h + 1, memory_order_release);
+    //without a writer nobody would read the counter
+    if (started) {
+        uint64_t one = 1;
+        write(wake_fd, &one, sizeof one);
+    }
+}
+
+void log_printf(int level, const char *fmt, ...) {
+    if (level > max_level) {
+        return;
+    }
+    char text[LOG_TEXT];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(text, sizeof text, fmt, args);
+    va_end(args);
+    //the callers end their messages with a newline like fprintf(), a record is a line already
+    size_t len = strlen(text);
+    if (len > 0 && text[len - 1] == '\n') {
+        text[len - 1] = '\0';
+    }
+
+    if (!started) {
+        fprintf(stderr, "%s\n", text);
+        return;
+    }
+    if (strcmp(text, last_text) == 0) {
+        repeats++;
+        return;
+    }
+    flush_repeats();
+    strcpy(last_text, text);
+    push(level, text);
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright 2018 Thomas Bocek
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+
+enum {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG,
+};
+
+//records that wait for the writer thread, a record is one line
+#define LOG_RING 256
+#define LOG_TEXT 120
+//at most LOG_BURST records at once and LOG_RATE per second on average, the rest is counted as dropped
+#define LOG_BURST 32
+#define LOG_RATE 10
+
+struct log_record {
+    uint8_t level;
+    char text[LOG_TEXT];
+};
+
+//messages above level are dropped without being formatted
+void log_init(int level);
+//from here on messages go through the ring and a writer thread, before they are written directly
+void log_start(void);
+//writes what is left in the ring and stops the thread
+void log_stop(void);
+//formats into a record without allocating or blocking, messages above the level are not even formatted
+void log_printf(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#endif
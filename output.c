@@ -0,0 +1,261 @@
+/*
+ * Copyright 2018 Thomas Bocek
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ */
+
+/*
+ * Writer thread
+ * =============
+ *
+ * With --writer-thread the event loop only reads and remaps. Every frame goes to a ring with one
+ * producer, the event loop, and one consumer, a thread that writes to uinput. If uinput does not
+ * take a write at once, the thread waits until it can write again, and the keyboards are read in
+ * the meantime. The ring only drops whole frames, when it is full. Then the writer releases every
+ * key it pressed, and the event loop presses the keys that are still held. A write that fails with
+ * an error other than EAGAIN is resynced the same way.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "output.h"
+
+//the writer copies nothing, the default stack of 8 MB would only be locked with -R
+#define OUTPUT_STACK (64 * 1024)
+//the writer waits for uinput as long as it takes, it only wakes up to notice output_stop()
+#define OUTPUT_WAIT_MS 1000
+//not an event type, tells the writer to release everything before the events that follow
+#define OUTPUT_RESYNC EV_CNT
+
+static struct input_event ring[OUTPUT_RING];
+//with -L the histogram of the device an event came from, its frames are measured when they are written
+static struct latency *owner[OUTPUT_RING];
+static clockid_t latency_clock;
+//head is written by the producer only, tail by the writer thread only
+static _Atomic unsigned int head, tail;
+static atomic_bool stopping,
+                   //a write failed, the writer cannot know which keys are pressed, output_resync() is due
+                   lost;
+static atomic_ulong failed;
+static int out_fd = -1,
+           wake_fd = -1;
+static pthread_t writer;
+static bool started;
+
+//producer side only
+static bool dropping;
+
+//writer side only, the keys that are pressed on the virtual device
+static uint64_t down[KEY_CNT / 64];
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+ssize_t output_write(int fd, const struct input_event *evs, size_t n, int timeout_ms) {
+    size_t size = n * sizeof *evs, done = 0;
+    long long deadline = now_ms() + timeout_ms;
+    int err = 0;
+    while (done < size) {
+        ssize_t written = write(fd, (const char *) evs + done, size - done);
+        if (written > 0) {
+            done += written;
+            continue;
+        }
+        err = written < 0 ? errno : EAGAIN;
+        long long left = deadline - now_ms();
+        if ((err != EAGAIN && err != EINTR) || left <= 0) {
+            break;
+        }
+        struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+        poll(&pfd, 1, (int) left);
+    }
+    if (done == 0 && size > 0) {
+        errno = err;
+        return -1;
+    }
+    return (ssize_t) done;
+}
+
+//gives up only on an error other than EAGAIN, or when uinput takes nothing after output_stop().
+//owners is NULL or has the histogram of every event.
+static void write_tracked(const struct input_event *evs, struct latency *const owners[], size_t n) {
+    size_t size = n * sizeof *evs, done = 0;
+    while (done < size) {
+        ssize_t written = write(out_fd, (const char *) evs + done, size - done);
+        if (written > 0) {
+            done += written;
+            continue;
+        }
+        if (written < 0 && errno != EAGAIN && errno != EINTR) {
+            break;
+        }
+        struct pollfd pfd = { .fd = out_fd, .events = POLLOUT };
+        if (poll(&pfd, 1, OUTPUT_WAIT_MS) == 0 && atomic_load(&stopping)) {
+            break;
+        }
+    }
+    if (done < size) {
+        atomic_fetch_add(&failed, 1);
+        atomic_store(&lost, true);
+    }
+    struct timespec now;
+    if (owners != NULL) {
+        clock_gettime(latency_clock, &now);
+    }
+    for (size_t i = 0; i < done / sizeof *evs; i++) {
+        if (owners != NULL && owners[i] != NULL && evs[i].type == EV_SYN && evs[i].code == SYN_REPORT) {
+            int64_t ns = (now.tv_sec - evs[i].time.tv_sec) * 1000000000LL + now.tv_nsec - evs[i].time.tv_usec * 1000LL;
+            latency_record(owners[i], ns > 0 ? ns : 0);
+        }
+        if (evs[i].type == EV_KEY && evs[i].code < KEY_CNT) {
+            uint64_t bit = 1ULL << (evs[i].code % 64);
+            down[evs[i].code / 64] = evs[i].value != 0 ? down[evs[i].code / 64] | bit : down[evs[i].code / 64] & ~bit;
+        }
+    }
+}
+
+//a release that got lost would leave its key stuck, a release of a key that is not pressed is ignored
+static void release_all(void) {
+    static struct input_event evs[KEY_CNT + 1];
+    size_t n = 0;
+    for (int code = 0; code < KEY_CNT; code++) {
+        if (down[code / 64] & (1ULL << (code % 64))) {
+            evs[n++] = (struct input_event) { .type = EV_KEY, .code = code, .value = 0 };
+        }
+    }
+    evs[n++] = (struct input_event) { .type = EV_SYN, .code = SYN_REPORT };
+    write_tracked(evs, NULL, n);
+    for (int i = 0; i < KEY_CNT / 64; i++) {
+        down[i] = 0;
+    }
+}
+
+static void *writer_main(void *arg) {
+    (void) arg;
+    for (;;) {
+        uint64_t value;
+        //blocks until the producer signals, a failed read just drains once more
+        if (read(wake_fd, &value, sizeof value) < 0) {
+            value = 0;
+        }
+        unsigned int t = atomic_load_explicit(&tail, memory_order_relaxed);
+        unsigned int h = atomic_load_explicit(&head, memory_order_acquire);
+        while (t != h) {
+            //up to the end of the ring or the next resync, as one write
+            unsigned int start = t % OUTPUT_RING, n = h - t, i = 0;
+            n = start + n > OUTPUT_RING ? OUTPUT_RING - start : n;
+            while (i < n && ring[start + i].type != OUTPUT_RESYNC) {
+                i++;
+            }
+            if (i > 0) {
+                write_tracked(&ring[start], &owner[start], i);
+            }
+            if (i < n) {
+                release_all();
+                i++;
+            }
+            t += i;
+            atomic_store_explicit(&tail, t, memory_order_release);
+        }
+        if (atomic_load(&stopping) && t == atomic_load_explicit(&head, memory_order_acquire)) {
+            return NULL;
+        }
+    }
+}
+
+bool output_start(int fd, clockid_t clock) {
+    out_fd = fd;
+    latency_clock = clock;
+    wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (wake_fd < 0) {
+        return false;
+    }
+    //unlike the log writer it inherits the realtime policy, a keystroke waits for it
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, OUTPUT_STACK);
+    started = pthread_create(&writer, &attr, writer_main, NULL) == 0;
+    pthread_attr_destroy(&attr);
+    if (!started) {
+        close(wake_fd);
+        wake_fd = -1;
+    }
+    return started;
+}
+
+void output_stop(void) {
+    if (!started) {
+        return;
+    }
+    atomic_store(&stopping, true);
+    uint64_t one = 1;
+    write(wake_fd, &one, sizeof one);
+    pthread_join(writer, NULL);
+    close(wake_fd);
+    started = false;
+}
+
+static size_t room(void) {
+    return OUTPUT_RING - (atomic_load_explicit(&head, memory_order_relaxed) -
+                          atomic_load_explicit(&tail, memory_order_acquire));
+}
+
+static void publish(const struct input_event *evs, size_t n, struct latency *latency) {
+    unsigned int h = atomic_load_explicit(&head, memory_order_relaxed);
+    for (size_t i = 0; i < n; i++) {
+        ring[(h + i) % OUTPUT_RING] = evs[i];
+        owner[(h + i) % OUTPUT_RING] = latency;
+    }
+    atomic_store_explicit(&head, h + (unsigned int) n, memory_order_release);
+    uint64_t one = 1;
+    write(wake_fd, &one, sizeof one);
+}
+
+bool output_push(const struct input_event *evs, size_t n, struct latency *latency) {
+    if (dropping || room() < n) {
+        dropping = true;
+        return false;
+    }
+    publish(evs, n, latency);
+    return true;
+}
+
+bool output_resync(void) {
+    //the keys that are held are pushed right after, half of the ring is more than enough
+    if (!output_dropped() || room() < OUTPUT_RING / 2) {
+        return false;
+    }
+    struct input_event resync = { .type = OUTPUT_RESYNC };
+    atomic_store(&lost, false);
+    publish(&resync, 1, NULL);
+    dropping = false;
+    return true;
+}
+
+bool output_dropped(void) {
+    return dropping || atomic_load(&lost);
+}
+
+unsigned long output_failed(void) {
+    return atomic_exchange(&failed, 0);
+}
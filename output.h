@@ -0,0 +1,53 @@
+/*
+ * Copyright 2018 Thomas Bocek
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ */
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+#include <linux/input.h>
+#include "latency.h"
+
+//events that wait for the writer thread, a power of two
+#define OUTPUT_RING 4096
+//a write that uinput did not take at once is retried for this long before its events are lost
+#define OUTPUT_RETRY_MS 10
+
+//writes all events, on EAGAIN or a short write waits until the fd is writable, at most timeout_ms in total.
+//Returns the bytes written, or -1 with errno if not even one event was written.
+ssize_t output_write(int fd, const struct input_event *evs, size_t n, int timeout_ms);
+//from here on output_push() hands the events to a thread that writes them to fd, false if there is no thread.
+//Latencies are measured against clock, the clock of the event timestamps.
+bool output_start(int fd, clockid_t clock);
+//writes what is left in the ring and stops the thread
+void output_stop(void);
+//copies whole frames to the ring without blocking. If they do not fit, they and everything pushed until
+//output_resync() are dropped, and false is returned. Unless latency is NULL, the writer thread records the
+//time from the timestamp of every SYN_REPORT until its write() returned in it.
+bool output_push(const struct input_event *evs, size_t n, struct latency *latency);
+//after a drop, or a write the writer gave up on: once there is room for the resync, the writer is told to release every key it pressed, and
+//true is returned. The caller then brings its own key state in line and pushes the keys that are held.
+bool output_resync(void);
+//events were dropped or not written, output_resync() is due
+bool output_dropped(void);
+//writes of the thread that failed since the last call
+unsigned long output_failed(void);
+
+#endif
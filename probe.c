@@ -0,0 +1,273 @@
+/*
+ * Copyright 2018 Thomas Bocek
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ */
+
+/*
+ * Latency probe
+ * =============
+ *
+ * Reads the virtual keyboard the way a compositor does and reports how long events took to arrive:
+ *
+ *   dvorak-probe [-d DEVICE]... [-n FRAMES] [-t SECONDS]
+ *
+ * The kernel stamps an event when uinput takes it, so the time from that stamp until read() returns is the
+ * delivery through evdev and the scheduler. Frames sent by dvorak --probe are counted as probes, key frames
+ * as keys. Run it on a keyboard that is not captured for the same numbers without the virtual device. Without
+ * -d all virtual keyboards are read. The report is one JSON object on stdout.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+#include "latency.h"
+#include "probe.h"
+
+#define PROBE_DEVICES 64
+#define VIRTUAL_NAME "Virtual Dvorak Keyboard"
+
+struct probe_device {
+    int fd;
+    char path[256],
+         name[256];
+    struct latency probes,
+                   keys;
+    //first and next expected sequence number, a gap counts as lost
+    bool seen;
+    unsigned int next_seq;
+    uint64_t lost;
+    bool key_in_frame;
+};
+
+static struct probe_device devices[PROBE_DEVICES];
+static int n_devices = 0;
+static volatile sig_atomic_t stop = 0;
+
+static void handle_signal(int sig) {
+    (void) sig;
+    stop = 1;
+}
+
+static bool open_probe(const char *path, bool only_virtual) {
+    if (n_devices == PROBE_DEVICES) {
+        return false;
+    }
+    struct probe_device *dev = &devices[n_devices];
+    memset(dev, 0, sizeof *dev);
+    dev->fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (dev->fd < 0) {
+        if (!only_virtual) {
+            fprintf(stderr, "Error: Cannot open [%s]: %s.\n", path, strerror(errno));
+        }
+        return false;
+    }
+    //the stamps are compared with CLOCK_MONOTONIC, which does not jump
+    int clock_id = CLOCK_MONOTONIC;
+    if (ioctl(dev->fd, EVIOCGNAME(sizeof dev->name - 1), dev->name) < 0 ||
+        (only_virtual && strcmp(dev->name, VIRTUAL_NAME) != 0) ||
+        ioctl(dev->fd, EVIOCSCLOCKID, &clock_id) < 0) {
+        if (!only_virtual) {
+            fprintf(stderr, "Error: Cannot read from [%s]: %s.\n", path, strerror(errno));
+        }
+        close(dev->fd);
+        return false;
+    }
+    snprintf(dev->path, sizeof dev->path, "%s", path);
+    n_devices++;
+    return true;
+}
+
+static void find_virtual(void) {
+    DIR *dir = opendir("/dev/input");
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "event", 5) == 0) {
+            char path[16 + sizeof entry->d_name];
+            snprintf(path, sizeof path, "/dev/input/%s", entry->d_name);
+            open_probe(path, true);
+        }
+    }
+    closedir(dir);
+}
+
+static uint64_t since(const struct timespec *now, const struct input_event *ev) {
+    long long ns = (now->tv_sec - (long long) ev->time.tv_sec) * 1000000000LL +
+                   now->tv_nsec - ev->time.tv_usec * 1000LL;
+    return ns > 0 ? (uint64_t) ns : 0;
+}
+
+//returns the number of probe frames that were read
+static uint64_t read_probe(struct probe_device *dev) {
+    struct input_event evs[64];
+    uint64_t probes = 0;
+    ssize_t n;
+    while ((n = read(dev->fd, evs, sizeof evs)) > 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        for (size_t i = 0; i < n / sizeof *evs; i++) {
+            const struct input_event *ev = &evs[i];
+            if (probe_tagged(ev)) {
+                unsigned int seq = probe_seq(ev);
+                if (dev->seen && seq != dev->next_seq) {
+                    dev->lost += (seq - dev->next_seq) & PROBE_SEQ_MASK;
+                }
+                dev->seen = true;
+                dev->next_seq = (seq + 1) & PROBE_SEQ_MASK;
+                latency_record(&dev->probes, since(&now, ev));
+                probes++;
+            } else if (ev->type == EV_KEY) {
+                dev->key_in_frame = true;
+            } else if (ev->type == EV_SYN && ev->code == SYN_REPORT && dev->key_in_frame) {
+                dev->key_in_frame = false;
+                latency_record(&dev->keys, since(&now, ev));
+            }
+        }
+    }
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+        fprintf(stderr, "Info: Device [%s] is gone: %s.\n", dev->path, n == 0 ? "end of file" : strerror(errno));
+        close(dev->fd);
+        dev->fd = -1;
+    }
+    return probes;
+}
+
+static void print_string(const char *s) {
+    putchar('"');
+    for (; *s != '\0'; s++) {
+        unsigned char c = (unsigned char) *s;
+        if (c == '"' || c == '\\') {
+            printf("\\%c", c);
+        } else if (c < 0x20) {
+            printf("\\u%04x", c);
+        } else {
+            putchar(c);
+        }
+    }
+    putchar('"');
+}
+
+//lost is only known for the probes
+static void print_latency(const char *key, const struct latency *latency, long long lost) {
+    printf("\"%s\": {\"frames\": %llu, ", key, (unsigned long long) latency->count);
+    if (lost >= 0) {
+        printf("\"lost\": %lld, ", lost);
+    }
+    printf("\"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu}",
+           (unsigned long long) latency_percentile(latency, 0.5),
+           (unsigned long long) latency_percentile(latency, 0.9),
+           (unsigned long long) latency_percentile(latency, 0.99),
+           (unsigned long long) latency->max_ns);
+}
+
+static void print_report(double seconds) {
+    printf("{\"clock\": \"monotonic\", \"seconds\": %.3f, \"devices\": [", seconds);
+    for (int i = 0; i < n_devices; i++) {
+        const struct probe_device *dev = &devices[i];
+        printf("%s\n  {\"path\": ", i > 0 ? "," : "");
+        print_string(dev->path);
+        printf(", \"name\": ");
+        print_string(dev->name);
+        printf(", ");
+        print_latency("probe", &dev->probes, (long long) dev->lost);
+        printf(", ");
+        print_latency("keys", &dev->keys, -1);
+        printf("}");
+    }
+    printf("\n]}\n");
+}
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    long frames = 0;
+    double seconds = 10;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:n:t:")) != -1) {
+        switch (opt) {
+            case 'd':
+                if (!open_probe(optarg, false)) {
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'n':
+                frames = strtol(optarg, NULL, 10);
+                break;
+            case 't':
+                seconds = strtod(optarg, NULL);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-d DEVICE]... [-n FRAMES] [-t SECONDS]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (n_devices == 0) {
+        find_virtual();
+    }
+    if (n_devices == 0) {
+        fprintf(stderr, "Error: No device [%s] found, is dvorak running and can /dev/input be read?\n",
+                VIRTUAL_NAME);
+        return EXIT_FAILURE;
+    }
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    struct pollfd fds[PROBE_DEVICES];
+    double start = now_s(), left = seconds;
+    uint64_t probes = 0;
+    while (!stop && left > 0 && (frames <= 0 || probes < (uint64_t) frames)) {
+        int n_open = 0;
+        for (int i = 0; i < n_devices; i++) {
+            fds[i] = (struct pollfd) { .fd = devices[i].fd, .events = POLLIN };
+            n_open += devices[i].fd >= 0;
+        }
+        if (n_open == 0) {
+            break;
+        }
+        int ret = poll(fds, n_devices, (int) (left * 1000) + 1);
+        if (ret < 0 && errno != EINTR) {
+            fprintf(stderr, "Error: Cannot wait for events: %s.\n", strerror(errno));
+            break;
+        }
+        for (int i = 0; ret > 0 && i < n_devices; i++) {
+            if (fds[i].revents != 0) {
+                probes += read_probe(&devices[i]);
+            }
+        }
+        left = seconds - (now_s() - start);
+    }
+    print_report(now_s() - start);
+    for (int i = 0; i < n_devices; i++) {
+        if (devices[i].fd >= 0) {
+            close(devices[i].fd);
+        }
+    }
+    return EXIT_SUCCESS;
+}
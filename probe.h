@@ -0,0 +1,38 @@
+/*
+ * Copyright 2018 Thomas Bocek
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ */
+
+#ifndef PROBE_H
+#define PROBE_H
+
+#include <stdbool.h>
+#include <linux/input.h>
+
+//--probe: the virtual device sends a frame with only a MSC_SCAN whose value is the tag and a sequence number.
+//Nothing reacts to a scan code without a key, dvorak-probe reads it back and measures how long it took.
+#define PROBE_TAG 0x7e000000
+#define PROBE_TAG_MASK 0xff000000
+#define PROBE_SEQ_MASK 0x00ffffff
+
+static inline bool probe_tagged(const struct input_event *ev) {
+    return ev->type == EV_MSC && ev->code == MSC_SCAN && ((unsigned int) ev->value & PROBE_TAG_MASK) == PROBE_TAG;
+}
+
+static inline unsigned int probe_seq(const struct input_event *ev) {
+    return (unsigned int) ev->value & PROBE_SEQ_MASK;
+}
+
+#endif
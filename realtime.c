@@ -0,0 +1,86 @@
+/*
+ * Copyright 2018 Thomas Bocek
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ */
+
+/*
+ * Realtime mode
+ * =============
+ *
+ * Every keystroke passes through this process. Under heavy load (make -j on all cores) a
+ * normal process can wait tens of ms for a CPU, or for a page that was swapped out. With
+ * --realtime all pages are locked before the loop starts, and with --rt-priority the loop
+ * runs as SCHED_FIFO ahead of all normal tasks. The loop sleeps in epoll_wait() and does
+ * very little work per event, so it cannot starve the rest of the system.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include "realtime.h"
+
+//touches the stack once, so the loop does not page fault when it goes deeper than before
+static void __attribute__((noinline)) prefault_stack(void) {
+    volatile unsigned char stack[REALTIME_STACK_PREFAULT];
+    for (size_t i = 0; i < sizeof stack; i += 4096) {
+        stack[i] = 0;
+    }
+}
+
+bool realtime_setup(const struct realtime *rt) {
+    bool ok = true;
+    if (rt->lock_memory) {
+        //MCL_CURRENT also faults in all pages that are mapped now, including the static buffers
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+            fprintf(stderr, "Warning: Cannot lock memory: %s.\n", strerror(errno));
+            fprintf(stderr, "Hint: Raise the limit with ulimit -l or LimitMEMLOCK=infinity.\n");
+            ok = false;
+        } else {
+            prefault_stack();
+        }
+    }
+
+    if (rt->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(rt->cpu, &set);
+        if (sched_setaffinity(0, sizeof set, &set) < 0) {
+            fprintf(stderr, "Warning: Cannot pin to CPU %d: %s.\n", rt->cpu, strerror(errno));
+            ok = false;
+        }
+    }
+
+    //SCHED_RESET_ON_FORK: a child process must not inherit the priority
+    if (rt->priority > 0) {
+        int min = sched_get_priority_min(SCHED_FIFO), max = sched_get_priority_max(SCHED_FIFO);
+        struct sched_param param = { .sched_priority = rt->priority };
+        if (rt->priority < min || rt->priority > max) {
+            fprintf(stderr, "Warning: Priority %d is not in [%d, %d].\n", rt->priority, min, max);
+            ok = false;
+        } else if (sched_setscheduler(0, SCHED_FIFO | SCHED_RESET_ON_FORK, &param) < 0) {
+            fprintf(stderr, "Warning: Cannot switch to SCHED_FIFO: %s.\n", strerror(errno));
+            ok = false;
+        }
+    } else if (rt->lock_memory) {
+        //systemd can set the policy instead, see CPUSchedulingPolicy in dvorak@.service
+        struct sched_param param;
+        if ((sched_getscheduler(0) & ~SCHED_RESET_ON_FORK) == SCHED_FIFO && sched_getparam(0, &param) == 0) {
+            fprintf(stderr, "Info: Running as SCHED_FIFO with priority %d.\n", param.sched_priority);
+        }
+    }
+    return ok;
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright 2018 Thomas Bocek
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ */
+
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <stdbool.h>
+
+//bytes of stack that are touched before the loop starts, the event loop needs only a few KiB
+#define REALTIME_STACK_PREFAULT (256 * 1024)
+
+struct realtime {
+    //lock all current and future pages and pre-fault the stack
+    bool lock_memory;
+    //SCHED_FIFO priority, 0 keeps the normal scheduler
+    int priority;
+    //CPU to pin to, -1 keeps the inherited affinity
+    int cpu;
+};
+
+//applies the settings, a setting that fails is reported and skipped. Returns false if any failed.
+bool realtime_setup(const struct realtime *rt);
+
+#endif
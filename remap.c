@@ -0,0 +1,350 @@
+/*
+ * Copyright 2018 Thomas Bocek
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ */
+
+/*
+ * Remapping core
+ * ==============
+ *
+ * Everything that decides which key is emitted lives here, without any I/O, so that the
+ * daemon and the replay benchmark in bench/ run the same code.
+ */
+#include <string.h>
+#include "remap.h"
+
+const unsigned char remap_modifier_bits[LAYOUT_KEYS] = {
+    //from: https://github.com/kentonv/dvorak-qwerty/tree/master/unix
+    [KEY_LEFTCTRL] = 1,
+    [KEY_RIGHTCTRL] = 2,
+    [KEY_LEFTALT] = 4,
+    [KEY_LEFTMETA] = 8,
+    [KEY_CAPSLOCK] = 16,
+};
+
+void remap_init(struct remap_config *config, const struct layout *layout, const struct rules *rules, bool no_toggle,
+                bool no_caps_lock) {
+    config->layout = layout;
+    config->no_toggle = no_toggle;
+    memcpy(config->modifier_bits, remap_modifier_bits, sizeof config->modifier_bits);
+    if (no_caps_lock) {
+        config->modifier_bits[KEY_CAPSLOCK] = 0;
+    }
+    config->rules = rules;
+    memset(config->trigger, 0, sizeof config->trigger);
+    if (rules != NULL) {
+        memcpy(config->trigger, rules->trigger, sizeof config->trigger);
+    }
+}
+
+//the layout: a key pressed while a modifier is held is emitted as the qwerty key
+static void remap_key(const struct remap_config *config, struct remap_state *state, const struct input_event ev,
+                      struct out_buf *out) {
+    if (state->disable_mapping && ev.type == EV_KEY && ev.value != 1 && ev.code < LAYOUT_KEYS &&
+        remap_held(state, ev.code)) {
+        //pressed as the qwerty key before the mapping was turned off, it repeats and is released as such
+        if (ev.value == 0) {
+            state->remapped[ev.code / 64] &= ~(1ULL << (ev.code % 64));
+        }
+        emit(out, ev.type, layout_key(config->layout, ev.code), ev.value, ev.time);
+        return;
+    }
+    if(!state->disable_mapping && ev.type == EV_KEY) {
+        int mod_current = ev.code < LAYOUT_KEYS ? config->modifier_bits[ev.code] : 0;
+
+        if (mod_current > 0) {
+            if (ev.value != 0) {
+                //set mod state when either 1 (key press), or 2 (repeat)
+                state->mod_state |= mod_current;
+            } else {
+                //remove mod state when 0 (released)
+                state->mod_state &= ~mod_current;
+            }
+        }
+
+        int qwerty_code = layout_key(config->layout, ev.code);
+        if (ev.code != qwerty_code) {
+            //pressed key, only keys below LAYOUT_KEYS are remapped
+            uint64_t bit = 1ULL << (ev.code % 64);
+            uint64_t *word = &state->remapped[ev.code / 64];
+            if (ev.value == 1) {
+                //modifier pressed
+                if(state->mod_state > 0) {
+                    *word |= bit;
+                    //remap to qwerty - press key
+                    emit(out, ev.type, qwerty_code, ev.value, ev.time);
+                } else {
+                    //no modifier
+                    emit(out, ev.type, ev.code, ev.value, ev.time);
+                }
+            } else if(ev.value == 2) {
+                //repeating button, a qwerty key if it was pressed with a modifier
+                emit(out, ev.type, (*word & bit) ? qwerty_code : ev.code, ev.value, ev.time);
+            } else if(ev.value == 0) {
+                //release the key
+                if(*word & bit) {
+                    *word &= ~bit;
+                    //remap to qwerty - release key
+                    emit(out, ev.type, qwerty_code, ev.value, ev.time);
+                } else {
+                    //regular dvorak key
+                    emit(out, ev.type, ev.code, ev.value, ev.time);
+                }
+            } else {
+                //this should not happen
+                emit(out, ev.type, ev.code, ev.value, ev.time);
+            }
+        } else {
+            //regular dvorak key
+            emit(out, ev.type, ev.code, ev.value, ev.time);
+        }
+    } else {
+        //non regular key
+        emit(out, ev.type, ev.code, ev.value, ev.time);
+    }
+}
+
+void remap_rebase(const struct remap_config *config, struct remap_state *state) {
+    state->mod_state = 0;
+    for (int code = 0; !state->disable_mapping && code < LAYOUT_KEYS; code++) {
+        if ((state->down[code / 64] >> (code % 64)) & 1) {
+            state->mod_state |= config->modifier_bits[code];
+        }
+    }
+}
+
+static bool test_bit64(const uint64_t bits[], unsigned int code) {
+    return (bits[code / 64] >> (code % 64)) & 1;
+}
+
+static void emit_key(struct out_buf *out, int code, int value, struct timeval time) {
+    emit(out, EV_KEY, code, value, time);
+}
+
+//taps the chords of rule. A shortcut that was matched with modifiers releases them first and presses them
+//again after, so the application sees only the keys of the chords.
+static void play_rule(const struct remap_config *config, const struct remap_state *state, const struct rule *rule,
+                      bool release_held, struct timeval time, struct out_buf *out) {
+    unsigned int held[REMAP_HELD_MAX];
+    int n_held = 0;
+    for (unsigned int code = 0; release_held && state->mod_state != 0 && code < LAYOUT_KEYS; code++) {
+        if (config->modifier_bits[code] == 0 || n_held == REMAP_HELD_MAX) {
+            continue;
+        }
+        //a modifier is out if it went through as it is, or if a decided tap-hold key holds it
+        bool is_out = test_bit64(state->down, code) && !test_bit64(state->ruled, code);
+        for (unsigned int key = 0; !is_out && key < LAYOUT_KEYS; key++) {
+            if (test_bit64(state->ruled, key) && state->pending != key) {
+                const struct rule *other = &config->rules->rule[state->rule_of[key]];
+                is_out = other->kind == RULE_TAP_HOLD && other->hold == code;
+            }
+        }
+        if (is_out) {
+            held[n_held++] = code;
+        }
+    }
+    if (n_held > 0) {
+        for (int i = 0; i < n_held; i++) {
+            emit_key(out, held[i], 0, time);
+        }
+        emit(out, EV_SYN, SYN_REPORT, 0, time);
+    }
+    const uint16_t *keys = rule->keys;
+    for (int c = 0; c < rule->n_chords; keys += rule->chord_len[c++]) {
+        for (int i = 0; i < rule->chord_len[c]; i++) {
+            emit_key(out, keys[i], 1, time);
+        }
+        emit(out, EV_SYN, SYN_REPORT, 0, time);
+        for (int i = rule->chord_len[c] - 1; i >= 0; i--) {
+            emit_key(out, keys[i], 0, time);
+        }
+        emit(out, EV_SYN, SYN_REPORT, 0, time);
+    }
+    for (int i = 0; i < n_held; i++) {
+        emit_key(out, held[i], 1, time);
+    }
+}
+
+//another key was pressed while a tap-hold key was held, or it was held too long, so it is held and not tapped
+static void decide_hold(const struct remap_config *config, struct remap_state *state, struct timeval time,
+                        struct out_buf *out) {
+    const struct rule *rule = &config->rules->rule[state->rule_of[state->pending]];
+    state->pending = 0;
+    if (rule->hold != 0) {
+        struct input_event press = { .time = time, .type = EV_KEY, .code = rule->hold, .value = 1 };
+        remap_key(config, state, press, out);
+    } else {
+        state->layer = rule->layer;
+    }
+}
+
+//true if a rule took the key event
+static bool apply_rules(const struct remap_config *config, struct remap_state *state, const struct input_event *ev,
+                        struct out_buf *out) {
+    const unsigned int code = ev->code;
+    if (code < LAYOUT_KEYS && test_bit64(state->ruled, code)) {
+        const struct rule *rule = &config->rules->rule[state->rule_of[code]];
+        bool decided = state->pending != code;
+        if (ev->value != 0) {
+            //a repeat taps a shortcut again, a held tap-hold key repeats its hold key
+            if (rule->kind == RULE_SEQUENCE) {
+                play_rule(config, state, rule, true, ev->time, out);
+            } else if (rule->kind == RULE_TAP_HOLD && decided && rule->hold != 0) {
+                struct input_event repeat = { .time = ev->time, .type = EV_KEY, .code = rule->hold, .value = 2 };
+                remap_key(config, state, repeat, out);
+            }
+            return true;
+        }
+        state->ruled[code / 64] &= ~(1ULL << (code % 64));
+        if (rule->kind == RULE_LAYER || (rule->kind == RULE_TAP_HOLD && decided && rule->hold == 0)) {
+            state->layer = 0;
+        } else if (rule->kind == RULE_TAP_HOLD && !decided) {
+            state->pending = 0;
+            play_rule(config, state, rule, false, ev->time, out);
+        } else if (rule->kind == RULE_TAP_HOLD) {
+            struct input_event release = { .time = ev->time, .type = EV_KEY, .code = rule->hold, .value = 0 };
+            remap_key(config, state, release, out);
+        }
+        return true;
+    }
+
+    if (ev->value != 1 || state->disable_mapping) {
+        return false;
+    }
+    if (state->pending != 0) {
+        decide_hold(config, state, ev->time, out);
+    }
+    const struct rule *rule = code < LAYOUT_KEYS ? rules_find(config->rules, state->layer, state->mod_state, code) : NULL;
+    if (rule == NULL) {
+        return false;
+    }
+    state->ruled[code / 64] |= 1ULL << (code % 64);
+    state->rule_of[code] = (uint16_t) (rule - config->rules->rule);
+    if (rule->kind == RULE_SEQUENCE) {
+        play_rule(config, state, rule, true, ev->time, out);
+    } else if (rule->kind == RULE_LAYER) {
+        state->layer = rule->layer;
+    } else {
+        state->pending = code;
+        state->pending_time = ev->time;
+    }
+    return true;
+}
+
+static struct timeval to_timeval(long long us) {
+    return (struct timeval) { .tv_sec = us / 1000000, .tv_usec = us % 1000000 };
+}
+
+bool remap_timeout(const struct remap_config *config, struct remap_state *state, long long now,
+                   struct out_buf *out) {
+    if (state->pending == 0 || now < remap_hold_deadline(config, state)) {
+        return false;
+    }
+    struct timeval time = to_timeval(remap_hold_deadline(config, state));
+    int len = out->len;
+    decide_hold(config, state, time, out);
+    //a layer has no output
+    if (out->len > len) {
+        emit(out, EV_SYN, SYN_REPORT, 0, time);
+    }
+    return true;
+}
+
+void remap_event(const struct remap_config *config, struct remap_state *state, const struct input_event *in,
+                 struct out_buf *out) {
+    const struct input_event ev = *in;
+    if (ev.type == EV_SYN && ev.code == SYN_DROPPED) {
+        //not forwarded, the resync after the next SYN_REPORT replaces the lost events
+        state->dropped = true;
+        return;
+    }
+    //the timer may not have fired yet, an event after the deadline sees the key held
+    if (state->pending != 0 && ev.type == EV_KEY &&
+        ev.time.tv_sec * 1000000LL + ev.time.tv_usec >= remap_hold_deadline(config, state)) {
+        decide_hold(config, state, to_timeval(remap_hold_deadline(config, state)), out);
+    }
+    remap_track(state, &ev);
+    if (!config->no_toggle && ev.code == KEY_LEFTALT) {
+        if (ev.value == 1 && ++state->l_alt >= 3) {
+            state->disable_mapping = !state->disable_mapping;
+            state->l_alt = 0;
+            //modifiers are not tracked while the mapping is off, start from the ones that are held now
+            remap_rebase(config, state);
+        }
+    } else if (ev.type == EV_KEY) {
+        state->l_alt = 0;
+    }
+
+    if (config->rules != NULL && ev.type == EV_KEY && apply_rules(config, state, &ev, out)) {
+        return;
+    }
+    remap_key(config, state, ev, out);
+}
+
+size_t remap_passthrough(const struct remap_config *config, struct remap_state *state,
+                         const struct input_event *in, size_t n) {
+    bool keys = false;
+    size_t i;
+    for (i = 0; i < n; i++) {
+        unsigned int code = in[i].code;
+        //the toggle looks at the code only, as in remap_event()
+        if (!config->no_toggle && code == KEY_LEFTALT) {
+            break;
+        }
+        if (in[i].type == EV_KEY) {
+            //while the mapping is off modifiers are not tracked, and rules do not apply
+            if (!state->disable_mapping && code < LAYOUT_KEYS &&
+                (config->modifier_bits[code] > 0 || test_bit64(config->trigger, code))) {
+                break;
+            }
+            remap_track(state, &in[i]);
+            keys = true;
+        } else if (in[i].type == EV_SYN && code == SYN_DROPPED) {
+            break;
+        }
+    }
+    if (keys) {
+        state->l_alt = 0;
+    }
+    return i;
+}
+
+static bool kernel_bit(const unsigned long bits[], int code) {
+    return (bits[code / (8 * sizeof(long))] >> (code % (8 * sizeof(long)))) & 1;
+}
+
+size_t remap_resync(const struct remap_config *config, struct remap_state *state, const unsigned long keys[],
+                    struct timeval time, struct input_event evs[REMAP_RESYNC_MAX]) {
+    size_t n = 0;
+    //releases before presses, and modifiers are released last and pressed first,
+    //so a key that is still held together with ctrl comes back remapped
+    for (int pass = 0; pass < 4; pass++) {
+        bool release = pass < 2,
+             modifiers = pass == 1 || pass == 2;
+        for (int code = 0; code < KEY_CNT; code++) {
+            bool is_modifier = code < LAYOUT_KEYS && config->modifier_bits[code] > 0,
+                 was_down = (state->down[code / 64] >> (code % 64)) & 1,
+                 is_down = kernel_bit(keys, code);
+            if (is_modifier == modifiers && was_down != is_down && was_down == release) {
+                evs[n++] = (struct input_event) { .time = time, .type = EV_KEY, .code = code, .value = is_down };
+            }
+        }
+    }
+    evs[n++] = (struct input_event) { .time = time, .type = EV_SYN, .code = SYN_REPORT };
+    state->dropped = false;
+    //the toggle counts real left alt taps only
+    state->l_alt = 0;
+    return n;
+}
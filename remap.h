@@ -0,0 +1,144 @@
+/*
+ * Copyright 2018 Thomas Bocek
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ */
+
+#ifndef REMAP_H
+#define REMAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <linux/input.h>
+#include "layout.h"
+#include "rules.h"
+
+//output events collected before they are written, the caller flushes at least once per read()
+#define OUT_MAX 128
+//room in the output buffer that remap_event() needs for one input event. A shortcut rule releases and presses
+//the held modifiers around its chords with a SYN_REPORT, and every chord is followed by one after the press and
+//the release. The press that decides a tap-hold key adds the hold key.
+#define REMAP_EVENT_MAX (2 * (RULE_KEYS + RULE_CHORDS) + 2 * REMAP_HELD_MAX + 2)
+//modifiers a shortcut rule releases at most
+#define REMAP_HELD_MAX 8
+//most events remap_resync() returns, a press or release per key and the SYN_REPORT
+#define REMAP_RESYNC_MAX (KEY_CNT + 1)
+
+struct out_buf {
+    struct input_event ev[OUT_MAX];
+    int len;
+};
+
+static inline void emit(struct out_buf *out, int type, int code, int value, struct timeval time) {
+    struct input_event *ev = &out->ev[out->len++];
+    ev->type = type;
+    ev->code = code;
+    ev->value = value;
+    ev->time = time;
+    //fprintf(stdout, "Emit event type=%d code=%d value=%d\n",ev->type, ev->code, ev->value);
+}
+
+//the options that change how keys are mapped, shared by all devices
+struct remap_config {
+    const struct layout *layout;
+    unsigned char modifier_bits[LAYOUT_KEYS];
+    bool no_toggle;
+    //NULL without rules, trigger is a copy of rules->trigger
+    const struct rules *rules;
+    uint64_t trigger[LAYOUT_KEYS / 64];
+};
+
+//every device keeps track of its own modifiers and remapped keys
+struct remap_state {
+    int l_alt,
+        mod_state;
+    bool disable_mapping;
+    //keys that were pressed with a modifier and are held, indexed by the code of the device
+    uint64_t remapped[LAYOUT_KEYS / 64];
+    //every key of the device that is held as far as the output knows
+    uint64_t down[KEY_CNT / 64];
+    //the kernel dropped events, everything up to the next SYN_REPORT is discarded before the resync
+    bool dropped;
+    //the layer of the rules, 0 is the base layer
+    int layer;
+    //a tap-hold key that is held and not decided yet, 0 if there is none, and the time of its press
+    unsigned int pending;
+    struct timeval pending_time;
+    //keys whose press went to a rule, the rule also gets the repeats and the release
+    uint64_t ruled[LAYOUT_KEYS / 64];
+    //index of that rule in rules->rule
+    uint16_t rule_of[LAYOUT_KEYS];
+};
+
+static inline bool remap_held(const struct remap_state *state, unsigned int code) {
+    return state->remapped[code / 64] & (1ULL << (code % 64));
+}
+
+//keeps down up to date, remap_event() and remap_passthrough() call it for every event
+static inline void remap_track(struct remap_state *state, const struct input_event *ev) {
+    if (ev->type == EV_KEY && ev->code < KEY_CNT) {
+        uint64_t *word = &state->down[ev->code / 64], bit = 1ULL << (ev->code % 64);
+        if (ev->value != 0) {
+            *word |= bit;
+        } else {
+            *word &= ~bit;
+        }
+    }
+}
+
+//no modifier and no remapped key is held, or the mapping is off: events pass through until a modifier edge
+static inline bool remap_idle(const struct remap_state *state) {
+    uint64_t held = 0, ruled = 0;
+    for (int i = 0; i < LAYOUT_KEYS / 64; i++) {
+        held |= state->remapped[i];
+        ruled |= state->ruled[i];
+    }
+    //a held layer or tap-hold key is always a ruled key, a remapped key is released as qwerty key even if the
+    //mapping was turned off in the meantime
+    return !state->dropped && ruled == 0 && held == 0 && (state->disable_mapping || state->mod_state == 0);
+}
+
+//in microseconds of the event clock: from then on the pending tap-hold key is held, decided by the next event
+//or by remap_timeout(). Only valid if state->pending != 0.
+static inline long long remap_hold_deadline(const struct remap_config *config, const struct remap_state *state) {
+    return state->pending_time.tv_sec * 1000000LL + state->pending_time.tv_usec + config->rules->hold_ms * 1000LL;
+}
+
+extern const unsigned char remap_modifier_bits[LAYOUT_KEYS];
+
+//rules may be NULL, the config does not own the layout or the rules
+void remap_init(struct remap_config *config, const struct layout *layout, const struct rules *rules, bool no_toggle,
+                bool no_caps_lock);
+//maps one input event, the output is appended to out, which needs room for REMAP_EVENT_MAX events
+void remap_event(const struct remap_config *config, struct remap_state *state, const struct input_event *in,
+                 struct out_buf *out);
+//the modifiers of the held keys under the modifier set of config, after a toggle or when config replaces
+//the config the state was built with
+void remap_rebase(const struct remap_config *config, struct remap_state *state);
+//decides the pending tap-hold key as held if now, in microseconds of the event clock, is past its deadline.
+//The hold key is appended to out with a SYN_REPORT, out needs room for REMAP_EVENT_MAX events.
+//Returns false if nothing was decided.
+bool remap_timeout(const struct remap_config *config, struct remap_state *state, long long now,
+                   struct out_buf *out);
+//after SYN_DROPPED: compares the keys that are held according to EVIOCGKEY with the keys the output has seen,
+//and writes the releases and presses that bring them in line to evs, followed by a SYN_REPORT. The events
+//are meant for remap_event(), so a release goes out with the code of its press. Returns the number of events.
+size_t remap_resync(const struct remap_config *config, struct remap_state *state, const unsigned long keys[],
+                    struct timeval time, struct input_event evs[REMAP_RESYNC_MAX]);
+//number of leading events that remap_event() would pass through unchanged, only valid if remap_idle().
+//The state is updated as if they went through remap_event(), they can be written as they are.
+size_t remap_passthrough(const struct remap_config *config, struct remap_state *state,
+                         const struct input_event *in, size_t n);
+
+#endif
@@ -0,0 +1,399 @@
+/*
+ * Copyright 2018 Thomas Bocek
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ */
+
+/*
+ * Rules
+ * =====
+ *
+ * With rules FILE in the config, or --rules FILE, keys can do more than follow the layout:
+ *
+ *   # a shortcut is tapped as a sequence of chords, the modifiers are ctrl, alt, win, and caps
+ *   ctrl+alt+k = ctrl+c ctrl+v
+ *   # caps lock alone is escape, held together with another key it is ctrl
+ *   tap-hold capslock = esc leftctrl
+ *   # held longer than this, in ms, a tap-hold key holds without waiting for another key
+ *   hold-time = 200
+ *   # while right alt is held, the rules of [nav] apply
+ *   layer rightalt = nav
+ *   [nav]
+ *   h = left
+ *   j = down
+ *
+ * Keys are named by the code the keyboard sends, before the layout, and are sent as they are
+ * written. A shortcut matches if exactly its modifiers are held, left and right ctrl are the
+ * same. A later rule replaces an earlier one for the same key and modifiers.
+ *
+ * Like a layout, the compiled rules are stored as FILE.cache next to the file and mapped read
+ * only, so all instances that use the same rules share one copy of the tables. A changed file
+ * is compiled by the first instance that loads it, the others map the new cache.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "rules.h"
+#include "log.h"
+#include "remap.h"
+
+#define RULES_CACHE_MAGIC 0x53454c5556440001ULL
+
+struct rules_cache {
+    uint64_t magic;
+    //the text file the cache was compiled from
+    int64_t mtime_sec,
+            mtime_nsec,
+            size;
+    uint64_t ino;
+    uint64_t checksum;
+    struct rules rules;
+};
+
+//modifier groups of a shortcut, anything else is a key
+static int modifier_group(const char *name) {
+    if (strcmp(name, "ctrl") == 0) {
+        return remap_modifier_bits[KEY_LEFTCTRL] | remap_modifier_bits[KEY_RIGHTCTRL];
+    } else if (strcmp(name, "alt") == 0) {
+        return remap_modifier_bits[KEY_LEFTALT];
+    } else if (strcmp(name, "win") == 0 || strcmp(name, "meta") == 0 || strcmp(name, "super") == 0) {
+        return remap_modifier_bits[KEY_LEFTMETA];
+    } else if (strcmp(name, "caps") == 0) {
+        return remap_modifier_bits[KEY_CAPSLOCK];
+    }
+    return 0;
+}
+
+//the output can name a modifier without its side
+static int output_key(const char *name) {
+    static const struct { const char *alias; int code; } aliases[] = {
+        { "ctrl", KEY_LEFTCTRL }, { "shift", KEY_LEFTSHIFT }, { "alt", KEY_LEFTALT },
+        { "win", KEY_LEFTMETA }, { "meta", KEY_LEFTMETA }, { "super", KEY_LEFTMETA },
+    };
+    for (size_t i = 0; i < sizeof aliases / sizeof *aliases; i++) {
+        if (strcmp(name, aliases[i].alias) == 0) {
+            return aliases[i].code;
+        }
+    }
+    return key_code(name);
+}
+
+static int find_layer(struct rules *rules, const char *name) {
+    if (strcmp(name, "base") == 0) {
+        return 0;
+    }
+    for (int i = 1; i < rules->n_layers; i++) {
+        if (strcmp(rules->layer[i], name) == 0) {
+            return i;
+        }
+    }
+    if (rules->n_layers == RULES_LAYERS || strlen(name) >= sizeof rules->layer[0]) {
+        return -1;
+    }
+    strcpy(rules->layer[rules->n_layers], name);
+    return rules->n_layers++;
+}
+
+//appends "a+b+c" to the chords of rule
+static const char *add_chord(struct rule *rule, char *chord) {
+    if (rule->n_chords == RULE_CHORDS) {
+        return "too many chords";
+    }
+    int len = 0, n_keys = 0;
+    for (int i = 0; i < rule->n_chords; i++) {
+        n_keys += rule->chord_len[i];
+    }
+    for (char *save, *name = strtok_r(chord, "+", &save); name != NULL; name = strtok_r(NULL, "+", &save)) {
+        int code = output_key(name);
+        if (code < 0) {
+            return "unknown key";
+        } else if (n_keys + len == RULE_KEYS) {
+            return "too many keys";
+        }
+        rule->keys[n_keys + len++] = code;
+    }
+    if (len == 0) {
+        return "empty chord";
+    }
+    rule->chord_len[rule->n_chords++] = len;
+    return NULL;
+}
+
+//one line of the file, returns an error message or NULL
+static const char *parse_rule(struct rules *rules, int *section, char *line) {
+    line[strcspn(line, "#\r\n")] = '\0';
+    char *words[2 + RULE_CHORDS], *save;
+    int n = 0;
+    for (char *word = strtok_r(line, " \t", &save); word != NULL; word = strtok_r(NULL, " \t", &save)) {
+        if (n == sizeof words / sizeof *words) {
+            return "too many words";
+        }
+        words[n++] = word;
+    }
+    if (n == 0) {
+        return NULL;
+    }
+    size_t len = strlen(words[0]);
+    if (n == 1 && len > 2 && words[0][0] == '[' && words[0][len - 1] == ']') {
+        words[0][len - 1] = '\0';
+        *section = find_layer(rules, words[0] + 1);
+        return *section < 0 ? "too many layers" : NULL;
+    }
+
+    if (strcmp(words[0], "hold-time") == 0) {
+        char *end = NULL;
+        long ms = n == 3 && strcmp(words[1], "=") == 0 ? strtol(words[2], &end, 10) : 0;
+        if (ms <= 0 || ms > 10000 || *end != '\0') {
+            return "expected hold-time = MS, at most 10000";
+        }
+        rules->hold_ms = (int) ms;
+        return NULL;
+    }
+
+    //KIND KEY = ... for layer and tap-hold, TRIGGER = ... for shortcuts
+    int kind = RULE_SEQUENCE, eq = 1;
+    if (strcmp(words[0], "layer") == 0) {
+        kind = RULE_LAYER;
+        eq = 2;
+    } else if (strcmp(words[0], "tap-hold") == 0) {
+        kind = RULE_TAP_HOLD;
+        eq = 2;
+    }
+    if (n < eq + 2 || strcmp(words[eq], "=") != 0) {
+        return "expected KEY = ...";
+    }
+    if (rules->n_rules == RULES_MAX) {
+        return "too many rules";
+    }
+    struct rule rule = { .kind = kind };
+
+    //all names but the last are modifier groups
+    int required[RULES_MOD_STATES], n_required = 0, code = -1, any = 0;
+    char *names[RULE_KEYS], *save_key;
+    int n_names = 0;
+    for (char *name = strtok_r(words[eq - 1], "+", &save_key); name != NULL; name = strtok_r(NULL, "+", &save_key)) {
+        if (n_names == RULE_KEYS) {
+            return "too many modifiers";
+        }
+        names[n_names++] = name;
+    }
+    for (int i = 0; i + 1 < n_names; i++) {
+        int group = modifier_group(names[i]);
+        if (group == 0) {
+            return "unknown modifier, use ctrl, alt, win, or caps";
+        }
+        required[n_required++] = group;
+        any |= group;
+    }
+    code = n_names > 0 ? key_code(names[n_names - 1]) : -1;
+    if (code < 0) {
+        return "unknown key";
+    }
+    if (kind != RULE_SEQUENCE && n_required > 0) {
+        return "layer and tap-hold keys have no modifiers";
+    }
+
+    const char *error = NULL;
+    if (kind == RULE_LAYER) {
+        int layer = n == eq + 2 ? find_layer(rules, words[eq + 1]) : -1;
+        if (layer <= 0) {
+            return n == eq + 2 ? "too many layers" : "expected one layer";
+        }
+        rule.layer = layer;
+    } else if (kind == RULE_TAP_HOLD) {
+        if (n != eq + 3) {
+            return "expected a tap chord and a hold key";
+        }
+        const char *hold = words[eq + 2];
+        if (hold[0] == '@') {
+            int layer = find_layer(rules, hold + 1);
+            if (layer <= 0) {
+                return "too many layers";
+            }
+            rule.layer = layer;
+        } else if (output_key(hold) < 0) {
+            return "unknown hold key";
+        } else {
+            rule.hold = output_key(hold);
+        }
+        error = add_chord(&rule, words[eq + 1]);
+    } else {
+        for (int i = eq + 1; error == NULL && i < n; i++) {
+            error = add_chord(&rule, words[i]);
+        }
+    }
+    if (error != NULL) {
+        return error;
+    }
+
+    int index = rules->n_rules++;
+    rules->rule[index] = rule;
+    for (int state = 0; state < RULES_MOD_STATES; state++) {
+        //exactly the required groups are held, a group is held if one of its keys is
+        bool match = kind != RULE_SEQUENCE || (state & ~any) == 0;
+        for (int i = 0; match && i < n_required; i++) {
+            match = (state & required[i]) != 0;
+        }
+        if (match) {
+            rules->table[*section][state][code] = index + 1;
+        }
+    }
+    return NULL;
+}
+
+static bool compile_rules(const char *path, struct rules *rules) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        log_printf(LOG_LEVEL_ERROR, "Error: Cannot open rules [%s]: %s.\n", path, strerror(errno));
+        return false;
+    }
+    rules->n_layers = 1;
+    rules->hold_ms = RULES_HOLD_MS;
+    strcpy(rules->layer[0], "base");
+
+    bool ok = true;
+    int section = 0;
+    char line[512];
+    for (int nr = 1; fgets(line, sizeof line, file) != NULL; nr++) {
+        const char *error = parse_rule(rules, &section, line);
+        if (error != NULL) {
+            log_printf(LOG_LEVEL_ERROR, "Error: %s:%d: %s.\n", path, nr, error);
+            ok = false;
+        }
+    }
+    fclose(file);
+    if (!ok) {
+        return false;
+    }
+
+    //a layer falls back to the base layer, so matching never needs a second lookup
+    for (int layer = 1; layer < rules->n_layers; layer++) {
+        for (int state = 0; state < RULES_MOD_STATES; state++) {
+            for (int code = 0; code < LAYOUT_KEYS; code++) {
+                uint16_t *entry = &rules->table[layer][state][code];
+                *entry = *entry != 0 ? *entry : rules->table[0][state][code];
+            }
+        }
+    }
+    for (int code = 0; code < LAYOUT_KEYS; code++) {
+        if (rules->table[0][0][code] != 0) {
+            rules->trigger[code / 64] |= 1ULL << (code % 64);
+        }
+    }
+    return true;
+}
+
+static const struct rules *map_cache(const char *cache_path, const struct stat *st) {
+    int fd = open(cache_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat cache_st;
+    if (fstat(fd, &cache_st) < 0 || cache_st.st_size != sizeof(struct rules_cache)) {
+        close(fd);
+        return NULL;
+    }
+    const struct rules_cache *cache = mmap(NULL, sizeof *cache, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (cache == MAP_FAILED) {
+        return NULL;
+    }
+    if (cache->magic != RULES_CACHE_MAGIC ||
+        cache->mtime_sec != st->st_mtim.tv_sec ||
+        cache->mtime_nsec != st->st_mtim.tv_nsec ||
+        cache->size != st->st_size ||
+        cache->ino != st->st_ino ||
+        cache->checksum != layout_checksum(&cache->rules, sizeof cache->rules)) {
+        munmap((void *) cache, sizeof *cache);
+        return NULL;
+    }
+    return &cache->rules;
+}
+
+//the same as the layout cache, the rename makes a new cache appear atomically for all instances
+static bool write_cache(const char *cache_path, const struct stat *st, struct rules_cache *cache) {
+    cache->magic = RULES_CACHE_MAGIC;
+    cache->mtime_sec = st->st_mtim.tv_sec;
+    cache->mtime_nsec = st->st_mtim.tv_nsec;
+    cache->size = st->st_size;
+    cache->ino = st->st_ino;
+    cache->checksum = layout_checksum(&cache->rules, sizeof cache->rules);
+
+    char tmp_path[PATH_MAX + 16];
+    snprintf(tmp_path, sizeof tmp_path, "%s.%d", cache_path, (int) getpid());
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        log_printf(LOG_LEVEL_INFO, "Info: Cannot write rules cache [%s]: %s.\n", cache_path, strerror(errno));
+        return false;
+    }
+    bool ok = write(fd, cache, sizeof *cache) == sizeof *cache;
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(tmp_path, cache_path) < 0) {
+        log_printf(LOG_LEVEL_INFO, "Info: Cannot write rules cache [%s]: %s.\n", cache_path, strerror(errno));
+        unlink(tmp_path);
+        return false;
+    }
+    return true;
+}
+
+const struct rules *rules_load(const char *path) {
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        log_printf(LOG_LEVEL_ERROR, "Error: Cannot open rules [%s]: %s.\n", path, strerror(errno));
+        return NULL;
+    }
+    char cache_path[PATH_MAX];
+    if (snprintf(cache_path, sizeof cache_path, "%s.cache", path) >= (int) sizeof cache_path) {
+        log_printf(LOG_LEVEL_ERROR, "Error: Rules path [%s] is too long.\n", path);
+        return NULL;
+    }
+    const struct rules *cached = map_cache(cache_path, &st);
+    if (cached != NULL) {
+        return cached;
+    }
+
+    //like a layout, loaded rules always live in a mapping of a whole cache
+    struct rules_cache *fresh = mmap(NULL, sizeof *fresh, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (fresh == MAP_FAILED) {
+        return NULL;
+    }
+    if (!compile_rules(path, &fresh->rules)) {
+        munmap(fresh, sizeof *fresh);
+        return NULL;
+    }
+    //the pages of the published cache are shared with every instance that maps it
+    if (write_cache(cache_path, &st, fresh) && (cached = map_cache(cache_path, &st)) != NULL) {
+        munmap(fresh, sizeof *fresh);
+        return cached;
+    }
+    //from here on the private copy is as read only as a mapped cache
+    mprotect(fresh, sizeof *fresh, PROT_READ);
+    return &fresh->rules;
+}
+
+void rules_free(const struct rules *rules) {
+    if (rules == NULL) {
+        return;
+    }
+    const struct rules_cache *cache = (const void *) ((const char *) rules - offsetof(struct rules_cache, rules));
+    munmap((void *) cache, sizeof *cache);
+}
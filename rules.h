@@ -0,0 +1,77 @@
+/*
+ * Copyright 2018 Thomas Bocek
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ */
+
+#ifndef RULES_H
+#define RULES_H
+
+#include <stdint.h>
+#include "layout.h"
+
+//the values of mod_state, one bit per modifier of remap_modifier_bits
+#define RULES_MOD_STATES 32
+//layer 0 is the base layer, the rules before the first [section]
+#define RULES_LAYERS 8
+#define RULES_MAX 1024
+//keys of all chords of one rule, and chords of one rule
+#define RULE_KEYS 12
+#define RULE_CHORDS 4
+//a tap-hold key that is held longer than this is held even if no other key is pressed, see hold-time
+#define RULES_HOLD_MS 200
+
+enum rule_kind {
+    //the chords are tapped one after the other when the key is pressed, and again on every repeat
+    RULE_SEQUENCE = 1,
+    //tapped: the first chord. Held while another key is pressed: the hold key, or the layer
+    RULE_TAP_HOLD,
+    //the layer is active while the key is held
+    RULE_LAYER,
+};
+
+struct rule {
+    uint8_t kind,
+            n_chords,
+            //number of keys of each chord in keys[], pressed in this order and released in reverse
+            chord_len[RULE_CHORDS],
+            layer;
+    //RULE_TAP_HOLD: the key that is held, 0 if it holds the layer
+    uint16_t hold;
+    uint16_t keys[RULE_KEYS];
+};
+
+//the compiled rule set. The table holds the index + 1 of the rule for every layer, modifier state and key,
+//the rules of the base layer are copied into the other layers, so matching is one lookup per event.
+struct rules {
+    int n_rules,
+        n_layers,
+        hold_ms;
+    char layer[RULES_LAYERS][32];
+    //keys with a rule in the base layer without modifiers, the fast path stops at them
+    uint64_t trigger[LAYOUT_KEYS / 64];
+    struct rule rule[RULES_MAX];
+    uint16_t table[RULES_LAYERS][RULES_MOD_STATES][LAYOUT_KEYS];
+};
+
+static inline const struct rule *rules_find(const struct rules *rules, int layer, int mod_state, unsigned int code) {
+    uint16_t i = rules->table[layer][mod_state & (RULES_MOD_STATES - 1)][code];
+    return i > 0 ? &rules->rule[i - 1] : NULL;
+}
+
+//compiles a rules file or maps its cache, NULL if it cannot be read or has errors. The rules are read only.
+const struct rules *rules_load(const char *path);
+void rules_free(const struct rules *rules);
+
+#endif
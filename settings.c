@@ -0,0 +1,197 @@
+/*
+ * Copyright 2018 Thomas Bocek
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ */
+
+/*
+ * Configuration file
+ * ==================
+ *
+ * With --config FILE the options below are read from FILE, and read again on SIGHUP or a
+ * "reload" on the control socket. The command line overrides the file.
+ *
+ *   # comment
+ *   layout colemak
+ *   match k750 k350
+ *   rules /etc/dvorak/rules
+ *   # while an app has the focus, see "focus" in control.c: off, on, or a layout
+ *   profile kitty off
+ *   profile jetbrains-idea colemak
+ *   toggle no
+ *   caps-lock-modifier no
+ *
+ * The control socket accepts the same lines, they override the current configuration.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "settings.h"
+#include "log.h"
+
+void settings_init(struct settings *settings) {
+    memset(settings, 0, sizeof *settings);
+    settings->no_toggle = -1;
+    settings->no_caps_lock = -1;
+}
+
+static bool set_profile(struct settings *settings, const struct settings_profile *profile) {
+    int i = 0;
+    while (i < settings->n_profiles && strcmp(settings->profiles[i].app, profile->app) != 0) {
+        i++;
+    }
+    if (i == SETTINGS_PROFILES) {
+        return false;
+    }
+    settings->profiles[i] = *profile;
+    settings->n_profiles += i == settings->n_profiles;
+    return true;
+}
+
+//"APP off", "APP on", or "APP LAYOUT"
+static bool parse_profile(struct settings *settings, const char *value) {
+    struct settings_profile profile = {0};
+    char mode[sizeof profile.layout], rest;
+    if (sscanf(value, "%63s %31s %c", profile.app, mode, &rest) != 2) {
+        return false;
+    }
+    if (strcmp(mode, "off") == 0) {
+        profile.off = true;
+    } else if (strcmp(mode, "on") != 0) {
+        strcpy(profile.layout, mode);
+    }
+    return set_profile(settings, &profile);
+}
+
+static int parse_bool(const char *value) {
+    if (strcmp(value, "yes") == 0 || strcmp(value, "on") == 0 || strcmp(value, "true") == 0) {
+        return 1;
+    } else if (strcmp(value, "no") == 0 || strcmp(value, "off") == 0 || strcmp(value, "false") == 0) {
+        return 0;
+    }
+    return -1;
+}
+
+bool settings_line(struct settings *settings, const char *line) {
+    char key[32];
+    int start, end;
+    line += strspn(line, " \t");
+    if (*line == '\0' || *line == '#') {
+        return true;
+    }
+    if (sscanf(line, "%31s %n", key, &start) != 1) {
+        return false;
+    }
+    //the value is the rest of the line without trailing whitespace
+    const char *value = line + start;
+    for (end = (int) strlen(value); end > 0 && strchr(" \t\r\n", value[end - 1]) != NULL; end--);
+
+    if (strcmp(key, "layout") == 0 && end > 0 && end < (int) sizeof settings->layout) {
+        memcpy(settings->layout, value, end);
+        settings->layout[end] = '\0';
+        return true;
+    } else if (strcmp(key, "match") == 0 && end < (int) sizeof settings->match) {
+        //an empty match captures every keyboard again
+        memcpy(settings->match, value, end);
+        settings->match[end] = '\0';
+        settings->has_match = true;
+        return true;
+    } else if (strcmp(key, "rules") == 0 && end < (int) sizeof settings->rules) {
+        //an empty value turns the rules off
+        memcpy(settings->rules, value, end);
+        settings->rules[end] = '\0';
+        settings->has_rules = true;
+        return true;
+    } else if (strcmp(key, "profile") == 0) {
+        return parse_profile(settings, value);
+    }
+
+    char flag[8] = "";
+    if (end < (int) sizeof flag) {
+        memcpy(flag, value, end);
+        flag[end] = '\0';
+    }
+    int on = parse_bool(flag);
+    if (strcmp(key, "toggle") == 0 && on >= 0) {
+        settings->no_toggle = !on;
+        return true;
+    } else if (strcmp(key, "caps-lock-modifier") == 0 && on >= 0) {
+        settings->no_caps_lock = !on;
+        return true;
+    }
+    return false;
+}
+
+bool settings_parse(struct settings *settings, const char *text) {
+    bool ok = true;
+    while (*text != '\0') {
+        size_t len = strcspn(text, "\n");
+        char line[PATH_MAX + 32];
+        if (len < sizeof line) {
+            memcpy(line, text, len);
+            line[len] = '\0';
+            if (!settings_line(settings, line)) {
+                log_printf(LOG_LEVEL_ERROR, "Error: Invalid setting [%s].\n", line);
+                ok = false;
+            }
+        } else {
+            log_printf(LOG_LEVEL_ERROR, "Error: Setting is too long.\n");
+            ok = false;
+        }
+        text += len + (text[len] == '\n');
+    }
+    return ok;
+}
+
+bool settings_load(struct settings *settings, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        log_printf(LOG_LEVEL_ERROR, "Error: Cannot open config [%s]: %s.\n", path, strerror(errno));
+        return false;
+    }
+    bool ok = true;
+    char line[PATH_MAX + 32];
+    for (int nr = 1; fgets(line, sizeof line, file) != NULL; nr++) {
+        if (!settings_line(settings, line)) {
+            log_printf(LOG_LEVEL_ERROR, "Error: %s:%d: invalid setting: %s", path, nr, line);
+            ok = false;
+        }
+    }
+    fclose(file);
+    return ok;
+}
+
+void settings_merge(struct settings *dst, const struct settings *src) {
+    if (src->layout[0] != '\0') {
+        strcpy(dst->layout, src->layout);
+    }
+    if (src->has_match) {
+        strcpy(dst->match, src->match);
+        dst->has_match = true;
+    }
+    if (src->has_rules) {
+        strcpy(dst->rules, src->rules);
+        dst->has_rules = true;
+    }
+    for (int i = 0; i < src->n_profiles; i++) {
+        set_profile(dst, &src->profiles[i]);
+    }
+    if (src->no_toggle >= 0) {
+        dst->no_toggle = src->no_toggle;
+    }
+    if (src->no_caps_lock >= 0) {
+        dst->no_caps_lock = src->no_caps_lock;
+    }
+}
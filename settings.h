@@ -0,0 +1,63 @@
+/*
+ * Copyright 2018 Thomas Bocek
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ */
+
+#ifndef SETTINGS_H
+#define SETTINGS_H
+
+#include <stdbool.h>
+#include <limits.h>
+
+#define SETTINGS_MATCH_MAX 256
+#define SETTINGS_PROFILES 32
+#define SETTINGS_APP_MAX 64
+
+//how the keyboards are remapped while an application has the focus
+struct settings_profile {
+    char app[SETTINGS_APP_MAX];
+    //a layout name, empty for the layout of the configuration
+    char layout[32];
+    //no modifier, no layout, and no rules apply
+    bool off;
+};
+
+//the options that can be changed while running. A field that is not set keeps the value from an earlier source.
+struct settings {
+    //empty if not set
+    char layout[PATH_MAX];
+    char match[SETTINGS_MATCH_MAX];
+    bool has_match;
+    //a path, empty for no rules, only used if has_rules
+    char rules[PATH_MAX];
+    bool has_rules;
+    //a profile replaces the one of an earlier source for the same app
+    struct settings_profile profiles[SETTINGS_PROFILES];
+    int n_profiles;
+    //-1 if not set, 0 or 1 otherwise
+    int no_toggle,
+        no_caps_lock;
+};
+
+void settings_init(struct settings *settings);
+//parses one "key value" line, the keys are layout, match, rules, profile, toggle, and caps-lock-modifier
+bool settings_line(struct settings *settings, const char *line);
+//parses every line of text, newline separated
+bool settings_parse(struct settings *settings, const char *text);
+bool settings_load(struct settings *settings, const char *path);
+//the fields that are set in src override dst
+void settings_merge(struct settings *dst, const struct settings *src);
+
+#endif
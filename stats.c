@@ -0,0 +1,234 @@
+/*
+ * Copyright 2018 Thomas Bocek
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ */
+
+/*
+ * Statistics
+ * ==========
+ *
+ * With --stats PATH the counters of every device live in a shared file, usually in /run/dvorak.
+ * The event loop only adds to them, it never locks, formats, or answers a request. A scraper maps
+ * the file read-only with dvorak --print-stats PATH... and gets the Prometheus text format, e.g.
+ * for the textfile collector of the node exporter. The file is removed when the process exits,
+ * a file left behind by a crash is skipped because its pid is gone.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include "stats.h"
+
+static struct stats_page *page;
+static const char *page_path;
+//the devices of a full page still count somewhere
+static struct device_stats overflow;
+
+bool stats_open(const char *path) {
+    int fd = -1;
+    if (path != NULL) {
+        //readable by everyone, written only by this process
+        fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0 || ftruncate(fd, sizeof *page) < 0) {
+            fprintf(stderr, "Error: Cannot create statistics file [%s]: %s.\n", path, strerror(errno));
+            if (fd >= 0) {
+                close(fd);
+                unlink(path);
+            }
+            return false;
+        }
+    }
+    void *addr = mmap(NULL, sizeof *page, PROT_READ | PROT_WRITE,
+                      fd >= 0 ? MAP_SHARED : MAP_PRIVATE | MAP_ANONYMOUS, fd, 0);
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "Error: Cannot map statistics: %s.\n", strerror(errno));
+        if (path != NULL) {
+            unlink(path);
+        }
+        return false;
+    }
+    page = addr;
+    page->version = STATS_VERSION;
+    page->pid = (uint32_t) getpid();
+    //last, a reader that sees the magic sees a complete header
+    __atomic_store_n(&page->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+    page_path = path;
+    return true;
+}
+
+void stats_close(void) {
+    if (page == NULL) {
+        return;
+    }
+    munmap(page, sizeof *page);
+    page = NULL;
+    if (page_path != NULL) {
+        unlink(page_path);
+        page_path = NULL;
+    }
+}
+
+static void set_active(struct device_stats *stats, bool active, const char *path, const char *name) {
+    __atomic_store_n(&stats->seq, stats->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    if (active) {
+        snprintf(stats->path, sizeof stats->path, "%s", path);
+        snprintf(stats->name, sizeof stats->name, "%s", name);
+        memset(&stats->events_read, 0, sizeof *stats - offsetof(struct device_stats, events_read));
+    }
+    stats->active = active;
+    __atomic_store_n(&stats->seq, stats->seq + 1, __ATOMIC_RELEASE);
+}
+
+struct device_stats *stats_attach(const char *path, const char *name) {
+    for (int i = 0; page != NULL && i < STATS_DEVICES; i++) {
+        if (!page->device[i].active) {
+            set_active(&page->device[i], true, path, name);
+            return &page->device[i];
+        }
+    }
+    return &overflow;
+}
+
+void stats_detach(struct device_stats *stats) {
+    if (stats != NULL && stats != &overflow) {
+        set_active(stats, false, NULL, NULL);
+    }
+}
+
+static const struct {
+    const char *name, *help;
+    size_t offset;
+} metrics[] = {
+    { "events_read", "Events read from the device.", offsetof(struct device_stats, events_read) },
+    { "events_emitted", "Events written to the virtual device.", offsetof(struct device_stats, events_emitted) },
+    { "remapped", "Key presses that were remapped.", offsetof(struct device_stats, remapped) },
+    { "repeats", "Autorepeat events read from the device.", offsetof(struct device_stats, repeats) },
+    { "toggles", "Times the mapping was switched on or off.", offsetof(struct device_stats, toggles) },
+    { "overflows", "Output buffer flushes in the middle of a frame.", offsetof(struct device_stats, overflows) },
+    { "dropped", "SYN_DROPPED reports of the kernel.", offsetof(struct device_stats, dropped) },
+    { "read_errors", "Failed or short reads from the device.", offsetof(struct device_stats, read_errors) },
+    { "write_errors", "Failed or short writes to the virtual device.", offsetof(struct device_stats, write_errors) },
+    { "bytes_written", "Bytes written to the virtual device.", offsetof(struct device_stats, bytes_written) },
+};
+
+//a consistent copy of an active slot, false if it is free or keeps changing
+static bool snapshot(const struct device_stats *stats, struct device_stats *copy) {
+    for (int tries = 0; tries < 100; tries++) {
+        uint32_t seq = __atomic_load_n(&stats->seq, __ATOMIC_ACQUIRE);
+        if (seq % 2 == 0) {
+            memcpy(copy, stats, sizeof *copy);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&stats->seq, __ATOMIC_RELAXED) == seq) {
+                return copy->active;
+            }
+        }
+    }
+    return false;
+}
+
+//label values in the Prometheus text format escape backslash, quote and newline
+static void print_label(const char *value) {
+    for (; *value != '\0'; value++) {
+        if (*value == '\\' || *value == '"') {
+            printf("\\%c", *value);
+        } else if (*value == '\n') {
+            printf("\\n");
+        } else {
+            putchar(*value);
+        }
+    }
+}
+
+static const struct stats_page *map_page(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot open statistics file [%s]: %s.\n", path, strerror(errno));
+        return NULL;
+    }
+    void *addr = mmap(NULL, sizeof *page, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "Error: Cannot map statistics file [%s]: %s.\n", path, strerror(errno));
+        return NULL;
+    }
+    const struct stats_page *p = addr;
+    if (__atomic_load_n(&p->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC || p->version != STATS_VERSION) {
+        fprintf(stderr, "Error: [%s] is not a statistics file of this version.\n", path);
+    } else if (kill((pid_t) p->pid, 0) < 0 && errno == ESRCH) {
+        fprintf(stderr, "Info: Skipping [%s], process %u is gone.\n", path, p->pid);
+    } else {
+        return p;
+    }
+    munmap(addr, sizeof *page);
+    return NULL;
+}
+
+int stats_print(int n, char *paths[]) {
+    const struct stats_page *pages[n > 0 ? n : 1];
+    struct device_stats (*copies)[STATS_DEVICES] = calloc(n > 0 ? n : 1, sizeof *copies);
+    bool (*active)[STATS_DEVICES] = calloc(n > 0 ? n : 1, sizeof *active);
+    if (copies == NULL || active == NULL) {
+        free(copies);
+        free(active);
+        return EXIT_FAILURE;
+    }
+    //one snapshot per device, so all metrics of a device are from the same moment
+    int failed = 0;
+    for (int i = 0; i < n; i++) {
+        pages[i] = map_page(paths[i]);
+        failed += pages[i] == NULL;
+        for (int d = 0; pages[i] != NULL && d < STATS_DEVICES; d++) {
+            active[i][d] = snapshot(&pages[i]->device[d], &copies[i][d]);
+        }
+    }
+
+    //every family once, with the devices of all pages below it
+    for (size_t m = 0; m < sizeof metrics / sizeof *metrics; m++) {
+        printf("# HELP dvorak_%s_total %s\n", metrics[m].name, metrics[m].help);
+        printf("# TYPE dvorak_%s_total counter\n", metrics[m].name);
+        for (int i = 0; i < n; i++) {
+            for (int d = 0; pages[i] != NULL && d < STATS_DEVICES; d++) {
+                if (!active[i][d]) {
+                    continue;
+                }
+                const struct device_stats *s = &copies[i][d];
+                printf("dvorak_%s_total{device=\"", metrics[m].name);
+                print_label(s->path);
+                printf("\",name=\"");
+                print_label(s->name);
+                printf("\"} %llu\n", (unsigned long long) *(const uint64_t *) ((const char *) s + metrics[m].offset));
+            }
+        }
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (pages[i] != NULL) {
+            munmap((void *) pages[i], sizeof *page);
+        }
+    }
+    free(copies);
+    free(active);
+    return failed == n && n > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
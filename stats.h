@@ -0,0 +1,72 @@
+/*
+ * Copyright 2018 Thomas Bocek
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define STATS_MAGIC 0x44564b53
+#define STATS_VERSION 1
+//one slot per captured device, the same limit as MAX_DEVICES
+#define STATS_DEVICES 64
+
+//counters of one device, only the event loop writes them. Every slot starts on its own cache line and the
+//counters do not share one with the labels, so a scraper never touches a line the loop is about to write.
+struct device_stats {
+    //odd while the slot is taken or released, a reader retries or skips the slot
+    uint32_t seq;
+    bool active;
+    char path[256];
+    char name[80];
+    uint64_t events_read __attribute__((aligned(64))),
+             events_emitted,
+             remapped,
+             repeats,
+             toggles,
+             //the output buffer was full before the end of a frame, MAX_LENGTH in older versions
+             overflows,
+             dropped,
+             read_errors,
+             write_errors,
+             bytes_written;
+} __attribute__((aligned(64)));
+
+//the layout of the file given with --stats, mapped read-only by --print-stats
+struct stats_page {
+    uint32_t magic,
+             version,
+             pid;
+    struct device_stats device[STATS_DEVICES];
+};
+
+//a plain add, the relaxed store only keeps a concurrent reader from seeing a torn value
+static inline void stats_add(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+//maps the page at path, without a path the counters are kept in private memory
+bool stats_open(const char *path);
+void stats_close(void);
+//a free slot for a device that joins the event loop, never NULL
+struct device_stats *stats_attach(const char *path, const char *name);
+void stats_detach(struct device_stats *stats);
+//the active devices of all pages in the Prometheus text format
+int stats_print(int n, char *paths[]);
+
+#endif
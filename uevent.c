@@ -0,0 +1,123 @@
+/*
+ * Copyright 2018 Thomas Bocek
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ */
+
+/*
+ * Minimal udev monitor
+ * ====================
+ *
+ * udev forwards every device event to its monitors over the NETLINK_KOBJECT_UEVENT socket once
+ * its rules ran, i.e., the device node exists and has its permissions. The message starts with
+ * a libudev header, followed by the properties as NUL separated KEY=VALUE strings. The kernel
+ * sends the same properties on its own group, prefixed with ACTION@DEVPATH instead of a header.
+ * This avoids a dependency on libudev for reading a handful of properties.
+ *
+ * The properties of a device that is already there are read from the database of udev in
+ * /run/udev/data/cMAJOR:MINOR, one E:KEY=VALUE line per property.
+ */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/sysmacros.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include "uevent.h"
+
+#define UEVENT_GROUP_UDEV 2
+#define UDEV_MONITOR_MAGIC 0xfeedcafe
+
+//from systemd: src/libsystemd/sd-device/device-monitor.c
+struct monitor_netlink_header {
+    char prefix[8];
+    unsigned magic;
+    unsigned header_size;
+    unsigned properties_off;
+    unsigned properties_len;
+    unsigned filter_subsystem_hash;
+    unsigned filter_devtype_hash;
+    unsigned filter_tag_bloom_hi;
+    unsigned filter_tag_bloom_lo;
+};
+
+int uevent_open(void) {
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0) {
+        return -1;
+    }
+    struct sockaddr_nl addr = { .nl_family = AF_NETLINK, .nl_groups = UEVENT_GROUP_UDEV };
+    if (bind(fd, (struct sockaddr *) &addr, sizeof addr) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool uevent_receive(int fd, struct uevent *event) {
+    ssize_t len = recv(fd, event->buf, sizeof event->buf - 1, 0);
+    if (len <= 0) {
+        return false;
+    }
+    event->buf[len] = '\0';
+
+    if (strcmp(event->buf, "libudev") == 0) {
+        const struct monitor_netlink_header *header = (const void *) event->buf;
+        if ((size_t) len < sizeof *header || ntohl(header->magic) != UDEV_MONITOR_MAGIC ||
+            header->properties_off >= (size_t) len || header->properties_len > len - header->properties_off) {
+            return false;
+        }
+        event->props_start = header->properties_off;
+        event->props_end = header->properties_off + header->properties_len;
+    } else {
+        //ACTION@DEVPATH, the properties follow after the first NUL
+        size_t header_len = strlen(event->buf) + 1;
+        if (strchr(event->buf, '@') == NULL || header_len >= (size_t) len) {
+            return false;
+        }
+        event->props_start = header_len;
+        event->props_end = len;
+    }
+    return true;
+}
+
+const char *uevent_get(const struct uevent *event, const char *key) {
+    size_t key_len = strlen(key);
+    for (size_t i = event->props_start; i < event->props_end; i += strlen(event->buf + i) + 1) {
+        const char *prop = event->buf + i;
+        if (strncmp(prop, key, key_len) == 0 && prop[key_len] == '=') {
+            return prop + key_len + 1;
+        }
+    }
+    return NULL;
+}
+
+void uevent_seat(dev_t devnum, char *seat, size_t size) {
+    snprintf(seat, size, "seat0");
+    char path[64], line[256];
+    snprintf(path, sizeof path, "/run/udev/data/c%u:%u", major(devnum), minor(devnum));
+    FILE *file = fopen(path, "re");
+    if (file == NULL) {
+        return;
+    }
+    while (fgets(line, sizeof line, file) != NULL) {
+        if (strncmp(line, "E:ID_SEAT=", 10) == 0) {
+            snprintf(seat, size, "%.*s", (int) strcspn(line + 10, "\n"), line + 10);
+        }
+    }
+    fclose(file);
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright 2018 Thomas Bocek
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ */
+
+#ifndef UEVENT_H
+#define UEVENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define UEVENT_BUFFER_SIZE 8192
+//longest seat name that is kept, like seat0 or seat-lab3
+#define UEVENT_SEAT_MAX 32
+
+//a device event as sent by udev after its rules ran, or by the kernel when udev is not involved
+struct uevent {
+    char buf[UEVENT_BUFFER_SIZE];
+    size_t props_start,
+           props_end;
+};
+
+//opens a non-blocking socket that receives the events processed by udev, -1 on error
+int uevent_open(void);
+//receives one pending event, false if there is none or it cannot be parsed
+bool uevent_receive(int fd, struct uevent *event);
+//returns the value of a property such as ACTION, DEVPATH, or DEVNAME, NULL if the event has none
+const char *uevent_get(const struct uevent *event, const char *key);
+//the seat of the device node devnum as assigned by udev with ID_SEAT, seat0 if it has none
+void uevent_seat(dev_t devnum, char *seat, size_t size);
+
+#endif
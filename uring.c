@@ -0,0 +1,189 @@
+/*
+ * Copyright 2018 Thomas Bocek
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ */
+
+/*
+ * io_uring without liburing
+ * =========================
+ *
+ * The event loop needs a handful of operations: reads that stay submitted, writes, and a poll.
+ * The rings are mapped as described in io_uring(7), the submission queue maps every slot to
+ * the entry with the same index, so entries are used in order.
+ */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+//a sqpoll thread that sees no work for this long goes to sleep, the next submit wakes it up
+#define URING_SQPOLL_IDLE_MS 1000
+
+static unsigned load_acquire(const unsigned *p) {
+    return atomic_load_explicit((const _Atomic unsigned *) p, memory_order_acquire);
+}
+
+static void store_release(unsigned *p, unsigned value) {
+    atomic_store_explicit((_Atomic unsigned *) p, value, memory_order_release);
+}
+
+bool uring_open(struct uring *ring, unsigned entries, bool sqpoll) {
+    memset(ring, 0, sizeof *ring);
+    struct io_uring_params params = { .flags = IORING_SETUP_CLAMP };
+    if (sqpoll) {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = URING_SQPOLL_IDLE_MS;
+    }
+    ring->fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return false;
+    }
+    //waiting with a timeout needs IORING_ENTER_EXT_ARG, since 5.11
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        uring_close(ring);
+        errno = ENOTSUP;
+        return false;
+    }
+    ring->sqpoll = sqpoll;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && ring->cq_ring_size > ring->sq_ring_size) {
+        ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    ring->cq_ring = single ? ring->sq_ring
+                           : mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                  ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        int error = errno;
+        uring_close(ring);
+        errno = error;
+        return false;
+    }
+
+    char *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_flags = (unsigned *) (sq + params.sq_off.flags);
+    ring->sq_mask = *(unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    unsigned *array = (unsigned *) (sq + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++) {
+        array[i] = i;
+    }
+    ring->local = ring->published = *ring->sq_tail;
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    return true;
+}
+
+void uring_close(struct uring *ring) {
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof *ring);
+    ring->fd = -1;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring) {
+    if (ring->local - load_acquire(ring->sq_head) >= ring->sq_entries) {
+        return NULL;
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[ring->local++ & ring->sq_mask];
+    memset(sqe, 0, sizeof *sqe);
+    return sqe;
+}
+
+struct io_uring_sqe *uring_last_sqe(struct uring *ring) {
+    return ring->local != ring->published ? &ring->sqes[(ring->local - 1) & ring->sq_mask] : NULL;
+}
+
+int uring_submit(struct uring *ring, unsigned wait, int timeout_ms) {
+    unsigned submit = ring->local - ring->published;
+    if (submit > 0) {
+        store_release(ring->sq_tail, ring->local);
+        ring->published = ring->local;
+    }
+    unsigned flags = wait > 0 ? IORING_ENTER_GETEVENTS : 0;
+    if (ring->sqpoll) {
+        //the tail store must be visible before the flag is read, see io_uring_enter(2)
+        atomic_thread_fence(memory_order_seq_cst);
+        if (submit > 0 && (load_acquire(ring->sq_flags) & IORING_SQ_NEED_WAKEUP)) {
+            flags |= IORING_ENTER_SQ_WAKEUP;
+        }
+        if (flags == 0) {
+            return (int) submit;
+        }
+    } else if (ring->local == load_acquire(ring->sq_head) && wait == 0) {
+        return 0;
+    }
+    struct __kernel_timespec ts = { .tv_sec = timeout_ms / 1000, .tv_nsec = timeout_ms % 1000 * 1000000LL };
+    struct io_uring_getevents_arg arg = { .ts = (uint64_t) (uintptr_t) &ts };
+    bool timed = wait > 0 && timeout_ms >= 0;
+    if (timed) {
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+    if (ring->sqpoll) {
+        long ret = syscall(__NR_io_uring_enter, ring->fd, 0, wait, flags, timed ? (void *) &arg : NULL,
+                           timed ? sizeof arg : 0);
+        return ret < 0 ? -errno : (int) submit;
+    }
+    //also the entries an earlier call left behind, the kernel takes them from its head on
+    int submitted = 0;
+    for (;;) {
+        unsigned pending = ring->local - load_acquire(ring->sq_head);
+        long ret = syscall(__NR_io_uring_enter, ring->fd, pending, wait, flags, timed ? (void *) &arg : NULL,
+                           timed ? sizeof arg : 0);
+        if (ret < 0) {
+            return submitted > 0 ? submitted : -errno;
+        }
+        submitted += (int) ret;
+        //the kernel does not wait after a partial submit, the rest goes again, unless it takes nothing
+        if ((unsigned) ret >= pending || ret == 0) {
+            return submitted;
+        }
+    }
+}
+
+bool uring_pop(struct uring *ring, struct io_uring_cqe *cqe) {
+    unsigned head = *ring->cq_head;
+    if (head == load_acquire(ring->cq_tail)) {
+        return false;
+    }
+    *cqe = ring->cqes[head & ring->cq_mask];
+    store_release(ring->cq_head, head + 1);
+    return true;
+}
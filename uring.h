@@ -0,0 +1,64 @@
+/*
+ * Copyright 2018 Thomas Bocek
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+//one io_uring, set up and driven with the raw system calls. Entries from uring_get_sqe() are only passed
+//to the kernel by uring_submit(), until then they can still be changed, also with SQPOLL.
+struct uring {
+    int fd;
+    bool sqpoll;
+    unsigned *sq_head,
+             *sq_tail,
+             *sq_flags,
+             sq_mask,
+             sq_entries,
+             //entries up to local are filled in, entries up to published are the kernel's
+             local,
+             published;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head,
+             *cq_tail,
+             cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring,
+         *cq_ring;
+    size_t sq_ring_size,
+           cq_ring_size,
+           sqes_size;
+};
+
+//with sqpoll a kernel thread picks up new entries, so submitting needs no system call while it is awake
+bool uring_open(struct uring *ring, unsigned entries, bool sqpoll);
+void uring_close(struct uring *ring);
+//a cleared entry at the end of the queue, NULL if the queue is full
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+//the newest entry that was not submitted yet, NULL if there is none
+struct io_uring_sqe *uring_last_sqe(struct uring *ring);
+//submits the new entries and waits for at least wait completions, at most timeout_ms unless it is -1.
+//Returns the number of entries the kernel took, entries it left are submitted with the next call, or -errno
+//such as -EINTR or -ETIME if it took none.
+int uring_submit(struct uring *ring, unsigned wait, int timeout_ms);
+//takes the oldest completion, false if there is none
+bool uring_pop(struct uring *ring, struct io_uring_cqe *cqe);
+
+#endif